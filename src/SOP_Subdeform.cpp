@@ -5,11 +5,20 @@
 #include <GU/GU_Detail.h>
 #include <OP/OP_Operator.h>
 #include <OP/OP_AutoLockInputs.h>
+#include <OP/OP_NodeInfoParms.h>
 #include <OP/OP_OperatorTable.h>
 #include <PRM/PRM_Include.h>
 #include <PRM/PRM_SpareData.h>
+#include <UT/UT_Thread.h>
 
 #include "math.hpp"
+#include "matrix_file.hpp"
+#include "basis.hpp"
+#include "basis_cache.hpp"
+#include "region_basis.hpp"
+#include "weight_stream.hpp"
+#include "profile.hpp"
+#include "projection_engine.hpp"
 #include "SOP_Subdeform.hpp"
 
 using namespace subdeform;
@@ -28,22 +37,70 @@ newSopOperator(OP_OperatorTable *table)
 }
 
 const char * subspacematrix_help = "File with subspace matrix generated by \
-subspace command like utility from rest pose and deformation samples.";
+subspace command like utility from rest pose and deformation samples. Region files \
+(subdeform --regions/--clusters) project every region onto its own basis; with a group \
+regions still see all their points, only the group's points move.";
+
+const char * weightstream_help = "Weight stream written by 'subdeform project --weights'. \
+Reconstruct mode sets P = rest + strength * U * w from it, input P isn't used.";
+
+const char * precision_help = "Precision of the basis kept in memory and of projection. \
+Single halves memory and bandwidth; half precision files stay half in memory.";
+
+const char * backgroundload_help = "Loads a new subspace file (or precision) on a background \
+thread. Until it's ready the node keeps using the previous matrix, or passes input through. \
+The first cook after opening a scene always loads in place.";
+
+const char * regularization_help = "Tikhonov regularization of least squares mode, relative \
+to the mean squared norm of the basis' columns. Damps weights of nearly dependent shapes.";
+
+const char * maxcomponents_help = "Uses only this many leading components of the basis \
+(0: all of them). Cost of projection grows linearly with components, so a low count gives a \
+fast preview and 0 the full quality, from one file. Region files keep all their components.";
+
+const char * variance_help = "Uses leading components of a PCA basis capturing this fraction of \
+the variance its singular values hold (1: all of them). Bases without singular values (raw \
+shapes) are limited by Max components only.";
+
+const char * profileattribs_help = "Writes timings of the cook stages (subdeform_<stage>_ms), \
+thread count and memory use as detail attributes. The same numbers are in the node info.";
 
 static PRM_Name  deformChoices[] = {
     PRM_Name("0", "Orthogonal"),
     PRM_Name("1", "Principal"),
+    PRM_Name("2", "Reconstruct"),
+    PRM_Name("3", "Least squares"),
     PRM_Name(0)
 };
 
 static PRM_ChoiceList  deformMenu(PRM_CHOICELIST_SINGLE, deformChoices);
 
+static PRM_Name precisionChoices[] = {
+    PRM_Name("0", "Double"),
+    PRM_Name("1", "Single"),
+    PRM_Name(0)
+};
+
+static PRM_ChoiceList  precisionMenu(PRM_CHOICELIST_SINGLE, precisionChoices);
+
 static PRM_Name names[] = {
     PRM_Name("subspacematrix",   "Subspace file"),
     PRM_Name("deformmode",       "Deform mode"),
     PRM_Name("strength",         "Strength"),
+    PRM_Name("precision",        "Precision"),
+    PRM_Name("weightstream",     "Weight stream"),
+    PRM_Name("weightframe",      "Weight frame"),
+    PRM_Name("profileattribs",   "Profile attributes"),
+    PRM_Name("backgroundload",   "Load in background"),
+    PRM_Name("regularization",   "Regularization"),
+    PRM_Name("maxcomponents",    "Max components"),
+    PRM_Name("variance",         "Variance"),
 };
 
+static PRM_Default frameDefault(0, "$F");
+static PRM_Range   regularizationRange(PRM_RANGE_RESTRICTED, 0, PRM_RANGE_UI, 0.1);
+static PRM_Range   maxcomponentsRange(PRM_RANGE_RESTRICTED, 0, PRM_RANGE_UI, 256);
+
 PRM_Template
 SOP_Subdeform::myTemplateList[] = {
     
@@ -55,6 +112,19 @@ SOP_Subdeform::myTemplateList[] = {
 
     PRM_Template(PRM_ORD,       1, &names[1], 0, &deformMenu, 0, 0, 0, 0, 0),
     PRM_Template(PRM_FLT_LOG,   1, &names[2], PRMoneDefaults, 0, 0, 0, 0, 0, 0),
+    PRM_Template(PRM_FLT,       1, &names[8], PRMzeroDefaults, 0, &regularizationRange, 0, 0, 0, 
+        regularization_help),
+    PRM_Template(PRM_INT,       1, &names[9], PRMzeroDefaults, 0, &maxcomponentsRange, 0, 0, 0,
+        maxcomponents_help),
+    PRM_Template(PRM_FLT,       1, &names[10], PRMoneDefaults, 0, &PRMunitRange, 0, 0, 0,
+        variance_help),
+    PRM_Template(PRM_ORD,       1, &names[3], PRMoneDefaults, &precisionMenu, 0, SOP_Subdeform::markDirty, 
+        0, 0, precision_help),
+    PRM_Template(PRM_TOGGLE,    1, &names[7], PRMoneDefaults, 0, 0, 0, 0, 0, backgroundload_help),
+    PRM_Template(PRM_FILE,      1, &names[4], 0, 0, 0, SOP_Subdeform::markStreamDirty, 
+        &PRM_SpareData::fileChooserModeRead, 0, weightstream_help),
+    PRM_Template(PRM_FLT,       1, &names[5], &frameDefault),
+    PRM_Template(PRM_TOGGLE,    1, &names[6], PRMzeroDefaults, 0, 0, 0, 0, 0, profileattribs_help),
     PRM_Template(),
 };
 
@@ -70,9 +140,73 @@ SOP_Subdeform::SOP_Subdeform(OP_Network *net, const char *name, OP_Operator *op)
 {
    
     mySopFlags.setManagesDataIDs(true);
+    m_engine.setProfile(&m_profile);
+    m_engine_f.setProfile(&m_profile);
+}
+
+SOP_Subdeform::~SOP_Subdeform() 
+{
+    if (m_load)
+        m_load->cancel();
 }
 
-SOP_Subdeform::~SOP_Subdeform() {}
+void
+SOP_Subdeform::startLoad()
+{
+    // Superseded load stops at its next checkpoint.
+    if (m_load)
+        m_load->cancel();
+    m_load = nullptr;
+    if (!BACKGROUNDLOAD()) {
+        m_needs_init = true;
+        return;
+    }
+    UT_String subspace_file, deformmode_str;
+    SUBSPACEMATRIX(subspace_file);
+    DEFORMMODE(deformmode_str);
+    // Thin Q (or Gram matrix) is prebuilt if the node is going to need it.
+    const int deform_mode = atoi(deformmode_str.buffer());
+    m_load = BasisCache::instance().load(subspace_file.c_str(), 
+        static_cast<Precision>(PRECISION()), deform_mode == deformation_space::ORTHO,
+        deform_mode == deformation_space::LEAST_SQUARES);
+    m_needs_init = false;
+}
+
+bool
+SOP_Subdeform::adoptBasis(const BasisHandle & basis)
+{
+    m_matrix = basis;
+    if (m_matrix->points() != gdp->getNumPoints()) {
+        m_matrix = nullptr;
+        addWarning(SOP_MESSAGE, "Matrix points count differs from input geo. Ignoring it.");
+        return false;
+    }
+    auto && message = std::ostringstream();
+    if (m_matrix->regional()) {
+        message << "Matrix regions: " << m_matrix->regions().size() << ", points: " << m_matrix->points();
+        message << ", shapes: " << m_matrix->regions().components();
+    } else {
+        message << "Matrix points: " << m_matrix->basis().rows() << ", shapes: " << m_matrix->basis().cols();
+    }
+    message << ", memory: " << m_matrix->memoryUsage() / (1024*1024) << "MB";
+    message << ", cache: " << BasisCache::instance().usage() / (1024*1024) << "MB";
+    addMessage(SOP_MESSAGE, message.str().c_str());
+    // Everything derived from the previous basis goes with it.
+    m_groupmatrix.close();
+    m_prefix.close();
+    m_orthoprefix.close();
+    m_projkey      = ProjectionKey();
+    m_stream_dirty = true;
+    ++m_basisserial;
+    return true;
+}
+
+void
+SOP_Subdeform::getNodeSpecificInfoText(OP_Context &context, OP_NodeInfoParms &iparms)
+{
+    SOP_Node::getNodeSpecificInfoText(context, iparms);
+    iparms.append(m_profile.text().c_str());
+}
 
 OP_ERROR
 SOP_Subdeform::cookInputGroups(OP_Context &context, int alone)
@@ -103,42 +237,165 @@ SOP_Subdeform::cookMySop(OP_Context &context)
         return error();
     
     fpreal t = context.getTime();
-    duplicatePointSource(0, context);
-    // should we care about the cost? (this won't change most of the time)
-    m_delta.conservativeResize(gdp->getNumPoints()*3);
-
-    if (m_needs_init == false && (m_matrix.rows() / 3 != gdp->getNumPoints())) {
-       addWarning(SOP_MESSAGE, "Matrix points' count differs from input geo. Ignoring it.");
-        return error();
-    }
+    const ProfileClock::time_point cook_start = ProfileClock::now();
 
     /// UI
-    UT_String subspace_file, deformmode_str;
+    UT_String subspace_file, deformmode_str, group_str;
     SUBSPACEMATRIX(subspace_file);
     DEFORMMODE(deformmode_str);
+    getGroups(group_str);
     const float strength  = STRENGTH(t);
     const int deform_mode = atoi(deformmode_str.buffer());
+    const Precision precision = static_cast<Precision>(PRECISION());
+    const bool profile_attribs = PROFILEATTRIBS() != 0;
+
+    // Input and parameters as last cooked: gdp still holds the output.
+    const GU_Detail * input = inputGeo(0, context);
+    CookKey cook_key;
+    cook_key.detail   = input->getUniqueId();
+    cook_key.meta     = input->getMetaCacheCount();
+    cook_key.output   = gdp->getP()->getDataId();
+    cook_key.strength = strength;
+    cook_key.mode     = deform_mode;
+    cook_key.basis    = m_basisserial;
+    cook_key.stream   = m_streamserial;
+    cook_key.frame    = deform_mode == deformation_space::RECONSTRUCT ? WEIGHTFRAME(t) : 0;
+    cook_key.regularization = deform_mode == deformation_space::LEAST_SQUARES ? REGULARIZATION(t) : 0;
+    cook_key.variance = VARIANCE(t);
+    cook_key.maxcomponents = MAXCOMPONENTS(t);
+    cook_key.profile  = profile_attribs;
+    cook_key.group    = group_str.toStdString();
+    m_profile.reset();
+    m_profile.threads = UT_Thread::getNumProcessors();
+    if (!m_needs_init && !m_load && !(m_stream_dirty && deform_mode == deformation_space::RECONSTRUCT) 
+        && cook_key == m_cookkey) {
+        m_profile.path = "unchanged";
+        m_profile.wall = seconds_since(cook_start);
+        return error();
+    }
+    m_cookkey = CookKey();
+    // Overwritten by finishProfile() once the cook gets through.
+    m_profile.path = "failed";
+
+    {
+        ScopedStage stage(&m_profile, Stage::Copy);
+        duplicatePointSource(0, context);
+    }
+
+    if (cookInputGroups(context) >= UT_ERROR_ABORT)
+        return error();
 
     if (error() >= UT_ERROR_ABORT)
         return error();
 
-    // (Re)Init matrices...
+    // (Re)Init matrices. The first cook (scene load, batch) loads in place,
+    // later file/precision changes load in the background (startLoad())
+    // while the node keeps cooking with the previous basis, or passes
+    // input through without one.
     if (m_needs_init) {
-        if(!read_matrix(subspace_file.c_str(), m_matrix)) {
-            addWarning(SOP_MESSAGE, "Failed to load the matrix file. Ignoring it.");
+        // Shared with other nodes using the same file.
+        ScopedStage stage(&m_profile, Stage::Load);
+        std::string load_error;
+        const BasisHandle loaded = BasisCache::instance().acquire(subspace_file.c_str(), 
+            precision, load_error);
+        if(!loaded) {
+            m_matrix = nullptr;
+            addWarning(SOP_MESSAGE, ("Failed to load the matrix file: " + load_error).c_str());
             return error();
         }
-        if (m_matrix.rows() / 3 != gdp->getNumPoints()) {
-            addWarning(SOP_MESSAGE, "Matrix points count differs from input geo. Ignoring it.");
+        DEBUG_PRINT("New matrix read: %s\n", subspace_file.c_str());
+        m_needs_init = false;
+        if (!adoptBasis(loaded))
             return error();
+    } else if (m_load) {
+        switch (m_load->state()) {
+            case BasisLoad::State::Ready:
+                DEBUG_PRINT("New matrix loaded in background: %s\n", m_load->filename().c_str());
+                if (!adoptBasis(m_load->result())) {
+                    m_load = nullptr;
+                    return error();
+                }
+                m_load = nullptr;
+                break;
+            case BasisLoad::State::Failed:
+                addWarning(SOP_MESSAGE, ("Failed to load the matrix file: " + m_load->error()).c_str());
+                m_load   = nullptr;
+                m_matrix = nullptr;
+                return error();
+            default: {
+                // The loader thread only publishes its state, cooks (all on
+                // this thread) pick it up; time dependent until then, so
+                // every frame change polls it.
+                flags().setTimeDep(true);
+                auto && message = std::ostringstream();
+                message << "Loading " << m_load->filename() << ": " 
+                    << int(100 * m_load->progress()) << "%";
+                message << (m_matrix ? ", using previous matrix." : ", passing input through.");
+                addMessage(SOP_MESSAGE, message.str().c_str());
+                m_profile.path = "loading";
+                break;
+            }
         }
+    }
+    cook_key.basis = m_basisserial;
+
+    // No basis (yet): input passes through.
+    if (!m_matrix)
+        return error();
+
+    if (m_matrix->points() != gdp->getNumPoints()) {
+        addWarning(SOP_MESSAGE, "Matrix points' count differs from input geo. Ignoring it.");
+        return error();
+    }
+
+    if (deform_mode == deformation_space::RECONSTRUCT && m_matrix->regional()) {
+        addWarning(SOP_MESSAGE, "Weight streams need a single (not regional) matrix.");
+        return error();
+    }
+
+    // Leading components to use, regions keep all of theirs. Truncating
+    // only narrows views of the shared basis, nothing is reloaded.
+    m_rank = m_matrix->regional() ? 0
+        : m_matrix->basis().truncatedRank(cook_key.variance, cook_key.maxcomponents);
+    if (!m_matrix->regional() && m_rank < m_matrix->basis().cols()) {
         auto && message = std::ostringstream();
-        message << "Matrix points: " << m_matrix.rows() << ", shapes: " << m_matrix.cols();
+        message << "Using " << m_rank << " of " << m_matrix->basis().cols() << " components.";
         addMessage(SOP_MESSAGE, message.str().c_str());
-        DEBUG_PRINT("New matrix read: %s\n", subspace_file.c_str());
-        m_transposed = m_matrix.transpose();
-        m_qrmatrix    = nullptr;
-        m_needs_init  = false;
+    }
+
+    // Stream is checked against the basis, so it's (re)opened after it.
+    if (deform_mode == deformation_space::RECONSTRUCT && m_stream_dirty) {
+        ScopedStage stage(&m_profile, Stage::Load);
+        UT_String stream_file;
+        WEIGHTSTREAM(stream_file);
+        if (!m_stream.open(stream_file.c_str())) {
+            addWarning(SOP_MESSAGE, ("Failed to load the weight stream: " + m_stream.error()).c_str());
+            return error();
+        }
+        if (m_stream.components() != m_matrix->basis().cols() || 
+            (m_stream.basisRows() && m_stream.basisRows() != m_matrix->basis().rows())) {
+            m_stream.close();
+            addWarning(SOP_MESSAGE, "Weight stream doesn't belong to this matrix. Ignoring it.");
+            return error();
+        }
+        auto && message = std::ostringstream();
+        message << "Weight stream frames: " << m_stream.frames() << ", components: " << m_stream.components();
+        addMessage(SOP_MESSAGE, message.str().c_str());
+        m_stream_dirty = false;
+        cook_key.stream = ++m_streamserial;
+    }
+
+    // Nothing to deform.
+    if (myGroup && myGroup->isEmpty()) {
+        finishProfile(0, "empty group", cook_start, profile_attribs);
+        cook_key.output = gdp->getP()->getDataId();
+        m_cookkey = cook_key;
+        return error();
+    }
+
+    if (myGroup) {
+        ScopedStage stage(&m_profile, Stage::Load);
+        updateGroupMatrix(deform_mode);
     }
 
     GA_Attribute * rest = gdp->findFloatTuple(GA_ATTRIB_POINT, "rest", 3);
@@ -147,47 +404,273 @@ SOP_Subdeform::cookMySop(OP_Context &context)
         return error();
     }
 
-    // (A) get weights from orthogonalized shape matrix 
-    // TODO: Just testing old approach (to be removed)
-    if (deform_mode == deformation_space::ORTHO) {
-        m_weights.conservativeResize(m_matrix.cols());
-        if(!position_delta(gdp, m_delta)) {
-            addWarning(SOP_MESSAGE, "Can't compute delta frame.");
+    // (A) project onto orthonormalized shape space: P -= strength * Q * Q^T * (P - rest)
+    // (B) principal components: P += strength * U * U^T * (P - rest)
+    // (D) least squares: P += strength * U * (U^T U + lambda I)^-1 * U^T * (P - rest),
+    //     for raw bases (regions are PCA bases, they run as (B)).
+    // With a group all run on rows gathered for its points only.
+    // Thin Q is built once per shared basis, by the first node asking for it.
+    // Regions are never gathered for a group, they always need it.
+    if ((!myGroup || m_matrix->regional()) && deform_mode == deformation_space::ORTHO) {
+        ScopedStage stage(&m_profile, Stage::Load);
+        m_matrix->ortho();
+    }
+    const bool least_squares = deform_mode == deformation_space::LEAST_SQUARES && !m_matrix->regional();
+    if (least_squares) {
+        ScopedStage stage(&m_profile, Stage::Load);
+        updateNormalSolver(cook_key.regularization);
+    }
+    // Thin Q of a column prefix is the prefix of the thin Q, both are views.
+    const SubspaceBasis & basis = myGroup ? m_groupmatrix 
+        : deform_mode == deformation_space::ORTHO ? truncated(m_matrix->ortho(), m_orthoprefix)
+        : truncated(m_matrix->basis(), m_prefix);
+    const float scale = deform_mode == deformation_space::ORTHO ? -strength : strength;
+    // Regions always read rows by point number, hence m_points even with a group.
+    m_points.update(*gdp);
+    const PointMap & points = myGroup ? m_grouppoints : m_points;
+
+    // (C) reconstruction: P = rest + strength * U * w(frame), w from the stream
+    // (U being the thin Q if weights were projected in ortho mode). A column
+    // prefix of U reads the leading weights only.
+    if (deform_mode == deformation_space::RECONSTRUCT) {
+        const SubspaceBasis & stream_basis = myGroup ? m_groupmatrix 
+            : m_stream.flags() & WEIGHTS_ORTHONORMAL ? truncated(m_matrix->ortho(), m_orthoprefix)
+            : truncated(m_matrix->basis(), m_prefix);
+        if (!reconstructFromStream(stream_basis, scale, WEIGHTFRAME(t), points)) {
+            addWarning(SOP_MESSAGE, "Can't read weights from the stream.");
             return error();
         }
-        if(m_qrmatrix == nullptr) {
-            DEBUG_PRINT("Building new QRMatrix... %s\n", "");
-            m_qrmatrix = std::move(QRMatrixPtr(new QRMatrix(m_matrix)));
-        }
-        // scalar product of delta and Q's columns:
-        Matrix weights_mat = m_delta.asDiagonal() * m_qrmatrix->matrixQR();
-        m_weights = std::move(weights_mat.colwise().sum());
-        apply_displacement(m_matrix, m_weights, strength, gdp);
-
-    } else if (deform_mode == deformation_space::PCA) {
+        finishProfile(stream_basis.cols(), "reconstructed", cook_start, profile_attribs);
+        gdp->getP()->bumpDataId();
+        cook_key.output = gdp->getP()->getDataId();
+        m_cookkey = cook_key;
+        return error();
+    }
 
-         if(!position_delta(gdp, m_delta)) {
+    // P - rest, basis and group as last projected: only strength (or
+    // attributes we don't read) changed, rescale kept displacement instead
+    // of sweeping the basis twice.
+    ProjectionKey projection_key;
+    projection_key.detail  = input->getUniqueId();
+    projection_key.p       = input->getP()->getDataId();
+    projection_key.rest    = input->findFloatTuple(GA_ATTRIB_POINT, "rest", 3)->getDataId();
+    projection_key.points  = gdp->getNumPoints();
+    projection_key.basis   = m_basisserial;
+    projection_key.mode    = deform_mode;
+    projection_key.grouped = myGroup != nullptr;
+    projection_key.group   = myGroup ? m_grouphash : 0;
+    projection_key.regularization = cook_key.regularization;
+    projection_key.rank    = m_rank;
+    if (projection_key == m_projkey) {
+        ScopedStage stage(&m_profile, Stage::Scatter);
+        displace_cached(m_displacement, scale, points, gdp);
+        m_profile.path = "cached displacement";
+    } else {
+        m_projkey = ProjectionKey();
+        const bool projected = m_matrix->regional()
+            ? projectRegions(deform_mode == deformation_space::ORTHO 
+                ? m_matrix->orthoRegions() : m_matrix->regions(), scale, points)
+            : projectDisplacement(basis, scale, points, least_squares ? &m_normal : nullptr);
+        if(!projected) {
             addWarning(SOP_MESSAGE, "Can't compute delta frame.");
             return error();
         }
-        // 
-        // NOTE: those parenthiss are importants
-        m_delta  = m_matrix * (m_transposed * m_delta);
-        GA_Offset ptoff;
-        GA_FOR_ALL_PTOFF(gdp, ptoff) {
-            const GA_Index ptidx  = gdp->pointIndex(ptoff);
-            const UT_Vector3 old  = gdp->getPos3(ptoff);
-            const Vector & v      = m_delta.segment<3>(ptidx*3);
-            const UT_Vector3 disp(v.data());
-            gdp->setPos3(ptoff, old + disp * strength);
-        }
-    
+        m_projkey = projection_key;
+        m_profile.alloc_bytes += m_displacement.size() * sizeof(UT_Vector3);
+        m_profile.path = "projected";
     }
+    finishProfile(m_matrix->regional() ? m_matrix->regions().components() : basis.cols(),
+        m_profile.path, cook_start, profile_attribs);
 
     // If we've modified P, and we're managing our own data IDs,
     // we must bump the data ID for P.
-    if (!myGroup || !myGroup->isEmpty())
-        gdp->getP()->bumpDataId();
+    gdp->getP()->bumpDataId();
 
+    cook_key.output = gdp->getP()->getDataId();
+    m_cookkey = cook_key;
     return error();
 }
+
+template<typename T>
+static bool
+project_displacement(ProjectionEngine<T> & engine, const SubspaceBasis & basis, 
+    const float scale, const PointMap & points, const NormalSolver * normal,
+    Eigen::Matrix<T, Eigen::Dynamic, 1> & weights, Displacement & displacement,
+    GU_Detail * gdp, Profile * profile)
+{
+    // Two sweeps over the basis: U^T * (P - rest), then P += scale * U * w.
+    if(!engine.project(basis, gdp, points, weights))
+        return false;
+    // K x K solve in between, no extra sweep.
+    if (normal) {
+        ScopedStage stage(profile, Stage::Project);
+        normal->solve(weights.data());
+    }
+    engine.displace(basis, weights, scale, points, gdp, &displacement);
+    return true;
+}
+
+bool
+SOP_Subdeform::projectDisplacement(const SubspaceBasis & basis, const float scale,
+    const PointMap & points, const NormalSolver * normal)
+{
+    if (basis.precision() == Precision::Single)
+        return project_displacement(m_engine_f, basis, scale, points, normal, m_weights_f, 
+            m_displacement, gdp, &m_profile);
+    return project_displacement(m_engine, basis, scale, points, normal, m_weights, 
+        m_displacement, gdp, &m_profile);
+}
+
+bool
+SOP_Subdeform::projectRegions(const RegionBasis & regions, const float scale,
+    const PointMap & points)
+{
+    const bool projected = regions.precision() == Precision::Single
+        ? m_engine_f.projectRegions(regions, gdp, m_points, m_displacement)
+        : m_engine.projectRegions(regions, gdp, m_points, m_displacement);
+    if (!projected)
+        return false;
+    ScopedStage stage(&m_profile, Stage::Scatter);
+    if (myGroup) {
+        // Cached displacement follows group members, as with a sub-basis.
+        Displacement members;
+        members.setSizeNoInit(m_groupindices.size());
+        for (size_t i = 0; i < m_groupindices.size(); ++i)
+            members(i) = m_displacement(m_groupindices[i]);
+        m_displacement.swap(members);
+    }
+    displace_cached(m_displacement, scale, points, gdp);
+    return true;
+}
+
+template<typename T>
+static bool
+reconstruct_from_stream(ProjectionEngine<T> & engine, WeightStream & stream,
+    const SubspaceBasis & basis, const float scale, const fpreal frame,
+    const PointMap & points, Eigen::Matrix<T, Eigen::Dynamic, 1> & weights,
+    GU_Detail * gdp, Profile * profile)
+{
+    // One seek and K values per cook, no projection.
+    weights.resize(stream.components());
+    {
+        ScopedStage stage(profile, Stage::Load);
+        if (!stream.read(stream.find(frame), weights.data()))
+            return false;
+    }
+    return engine.reconstruct(basis, weights, scale, points, gdp);
+}
+
+bool
+SOP_Subdeform::reconstructFromStream(const SubspaceBasis & basis, const float scale,
+    const fpreal frame, const PointMap & points)
+{
+    if (basis.precision() == Precision::Single)
+        return reconstruct_from_stream(m_engine_f, m_stream, basis, scale, frame, points,
+            m_weights_f, gdp, &m_profile);
+    return reconstruct_from_stream(m_engine, m_stream, basis, scale, frame, points,
+        m_weights, gdp, &m_profile);
+}
+
+void
+SOP_Subdeform::updateGroupMatrix(const int deform_mode)
+{
+    UT_Array<GA_Offset> offsets;
+    m_groupindices.clear();
+    GA_Offset ptoff;
+    GA_FOR_ALL_GROUP_PTOFF(gdp, myGroup, ptoff) {
+        offsets.append(ptoff);
+        m_groupindices.push_back(gdp->pointIndex(ptoff));
+    }
+    m_grouppoints.assign(offsets);
+    // Reconstruction needs rows of the basis the weights were computed with.
+    const bool from_ortho = deform_mode == deformation_space::RECONSTRUCT &&
+        (m_stream.flags() & WEIGHTS_ORTHONORMAL);
+    // Membership signature: sub-basis is only rebuilt when it (or rank) changes.
+    const uint64_t hash = checksum64(m_groupindices.data(), 
+        m_groupindices.size()*sizeof(int64_t)) ^ deform_mode ^ (uint64_t(from_ortho) << 8)
+        ^ (uint64_t(m_rank) << 16);
+    // Regions project all their points, group only masks the result.
+    if (m_matrix->regional()) {
+        m_grouphash = hash;
+        return;
+    }
+    if (m_groupmatrix.isOpen() && hash == m_grouphash)
+        return;
+
+    DEBUG_PRINT("Gathering sub-basis for %i points...\n", (int)m_groupindices.size());
+    m_groupmatrix.gatherRows(from_ortho ? truncated(m_matrix->ortho(), m_orthoprefix)
+        : truncated(m_matrix->basis(), m_prefix), m_groupindices);
+    if (deform_mode == deformation_space::ORTHO)
+        m_groupmatrix.orthonormalize();
+    if (deform_mode == deformation_space::LEAST_SQUARES)
+        m_groupmatrix.gram(m_groupgram);
+    m_grouphash = hash;
+}
+
+void
+SOP_Subdeform::updateNormalSolver(const fpreal regularization)
+{
+    // Gram matrix itself is built once per basis (or group), refactoring
+    // is O(K^3) on a K x K matrix.
+    const uint64_t group = myGroup ? m_grouphash : 0;
+    if (m_normal.isValid() && m_normalbasis == m_basisserial && m_normalrank == m_rank 
+        && m_normalgroup == group && m_normal.regularization() == regularization)
+        return;
+    // Gram matrix of a column prefix is the leading block of the full one.
+    if (myGroup)
+        m_normal.factor(m_groupgram, regularization);
+    else
+        m_normal.factor(m_matrix->gram().topLeftCorner(m_rank, m_rank), regularization);
+    m_normalbasis = m_basisserial;
+    m_normalrank  = m_rank;
+    m_normalgroup = group;
+}
+
+const SubspaceBasis &
+SOP_Subdeform::truncated(const SubspaceBasis & full, SubspaceBasis & prefix)
+{
+    if (m_rank >= full.cols())
+        return full;
+    // Pointers and K singular values, no basis data is touched.
+    prefix.viewColumns(full, m_rank);
+    return prefix;
+}
+
+void
+SOP_Subdeform::finishProfile(const int64 components, const char * path,
+    const ProfileClock::time_point start, const bool attributes)
+{
+    m_profile.path        = path;
+    m_profile.points      = myGroup ? m_grouppoints.size() : gdp->getNumPoints();
+    m_profile.components  = components;
+    m_profile.basis_bytes = m_matrix->memoryUsage() + (myGroup ? m_groupmatrix.memoryUsage() : 0);
+    m_profile.wall        = seconds_since(start);
+    if (!attributes)
+        return;
+
+    auto set_float = [this](const std::string & name, const double value) {
+        GA_Attribute * attrib = gdp->addFloatTuple(GA_ATTRIB_DETAIL, name.c_str(), 1);
+        GA_RWHandleF handle(attrib);
+        if (handle.isValid()) {
+            handle.set(GA_Offset(0), value);
+            attrib->bumpDataId();
+        }
+    };
+    auto set_int = [this](const std::string & name, const int64 value) {
+        GA_Attribute * attrib = gdp->addIntTuple(GA_ATTRIB_DETAIL, name.c_str(), 1, 
+            GA_Defaults(0), 0, 0, GA_STORE_INT64);
+        GA_RWHandleID handle(attrib);
+        if (handle.isValid()) {
+            handle.set(GA_Offset(0), value);
+            attrib->bumpDataId();
+        }
+    };
+    for (int i = 0; i < STAGE_COUNT; ++i) {
+        set_float(std::string("subdeform_") + stage_name(static_cast<Stage>(i)) + "_ms", 
+            1e3 * m_profile.seconds[i]);
+    }
+    set_float("subdeform_wall_ms", 1e3 * m_profile.wall);
+    set_int("subdeform_threads",     m_profile.threads);
+    set_int("subdeform_basis_bytes", m_profile.basis_bytes);
+    set_int("subdeform_alloc_bytes", m_profile.alloc_bytes);
+}
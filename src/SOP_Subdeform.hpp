@@ -14,53 +14,28 @@ namespace subdeform {
 enum deformation_space {
     ORTHO,
     PCA,
+    RECONSTRUCT, // rest + U * w with w read from a weight stream
+    LEAST_SQUARES, // P + U * w, w least squares fit of P - rest (raw bases)
 };
 
-inline bool position_delta(const GU_Detail * gdp, Vector & delta) {
-    GA_ROHandleV3 rest_h(gdp->findFloatTuple(GA_ATTRIB_POINT, "rest", 3));
-    GA_Offset ptoff;
-    GA_FOR_ALL_PTOFF(gdp, ptoff) {
-        const GA_Index ptidx  = gdp->pointIndex(ptoff);
-        const UT_Vector3 pos  = gdp->getPos3(ptoff);
-        const UT_Vector3 rest = rest_h.get(ptoff);
-        delta(3*ptidx + 0) = pos.x() - rest.x();
-        delta(3*ptidx + 1) = pos.y() - rest.y();
-        delta(3*ptidx + 2) = pos.z() - rest.z();
-    } 
-    return true;   
-}
-
-inline void apply_displacement(const Matrix & matrix, 
-    const Vector & weights, const float strength, GU_Detail * gdp) {
-    GA_Offset ptoff;
-    GA_FOR_ALL_PTOFF(gdp, ptoff) {
-        const GA_Index ptidx  = gdp->pointIndex(ptoff);
-        UT_Vector3 disp(0,0,0);
-        for(int col=0; col<matrix.cols(); ++col) {
-            const float xd = matrix(3*ptidx + 0, col);
-            const float yd = matrix(3*ptidx + 1, col);
-            const float zd = matrix(3*ptidx + 2, col);
-            const float w  = weights(col); 
-            disp += UT_Vector3(xd, yd, zd) * w ;
-        }
-        const UT_Vector3 rest = gdp->getPos3(ptoff);
-        gdp->setPos3(ptoff, rest - (disp * strength));
-    }
-}
-
 class SOP_Subdeform : public SOP_Node
 {
 public:
     typedef Eigen::VectorXd              DeltaVector;
-    typedef Eigen::HouseholderQR<Matrix> QRMatrix;
-    typedef std::unique_ptr<QRMatrix>    QRMatrixPtr;
-    typedef std::unique_ptr<Eigen::VectorXd> WeightsVector;
+    typedef Eigen::VectorXf              DeltaVectorF;
     SOP_Subdeform(OP_Network *net, const char *name, OP_Operator *op);
     virtual ~SOP_Subdeform();
-    /// Mark internal storage needs to be recreated (m_matrix, ...)
+    /// Mark internal storage needs to be recreated (m_matrix, ...). The new
+    /// basis starts loading right away (see startLoad()).
     static int markDirty(void *data, int, fpreal, const PRM_Template *) { 
         SOP_Subdeform *node = static_cast<SOP_Subdeform*>(data);
-        node->m_needs_init = true;
+        node->startLoad();
+        return 1;
+    }
+    /// Mark weight stream needs to be reopened.
+    static int markStreamDirty(void *data, int, fpreal, const PRM_Template *) { 
+        SOP_Subdeform *node = static_cast<SOP_Subdeform*>(data);
+        node->m_stream_dirty = true;
         return 1;
     }
     
@@ -68,6 +43,10 @@ public:
     static OP_Node      *myConstructor(OP_Network*, const char *,
                                 OP_Operator *);
 
+    /// Timings and counters of the last cook (see Profile).
+    virtual void             getNodeSpecificInfoText(OP_Context &context,
+                                OP_NodeInfoParms &iparms);
+
     /// This method is created so that it can be called by handles.  It only
     /// cooks the input group of this SOP.  The geometry in this group is
     /// the only geometry manipulated by this SOP.
@@ -79,20 +58,147 @@ protected:
     virtual OP_ERROR         cookMySop(OP_Context &context);
 
 private:
+    /// Input state the cached displacement was computed from. Equal keys
+    /// mean P - rest, basis and group didn't change, so only strength may
+    /// have (see cookMySop()).
+    struct ProjectionKey {
+        exint     detail = -1;
+        GA_DataId p      = GA_INVALID_DATAID;
+        GA_DataId rest   = GA_INVALID_DATAID;
+        GA_Size   points = -1;
+        int       basis  = -1;  // m_basisserial
+        int       mode   = -1;
+        bool      grouped = false;
+        uint64_t  group  = 0;   // m_grouphash
+        fpreal    regularization = 0; // LEAST_SQUARES only
+        int64     rank   = -1;  // m_rank
+        bool operator==(const ProjectionKey & other) const {
+            return detail == other.detail && p == other.p && rest == other.rest
+                && points == other.points && basis == other.basis && mode == other.mode
+                && grouped == other.grouped && group == other.group
+                && regularization == other.regularization && rank == other.rank;
+        }
+    };
+    /// Input and parameters gdp was cooked from. Equal keys mean gdp still
+    /// holds the right output.
+    struct CookKey {
+        exint       detail = -1;
+        exint       meta   = -1;
+        GA_DataId   output = GA_INVALID_DATAID; // gdp's P after the cook
+        fpreal      strength = 0;
+        int         mode   = -1;
+        int         basis  = -1;
+        int         stream = -1;  // m_streamserial
+        fpreal      frame  = 0;   // weight frame (RECONSTRUCT only)
+        fpreal      regularization = 0; // LEAST_SQUARES only
+        fpreal      variance = 1;
+        int         maxcomponents = 0;
+        bool        profile = false; // profile attributes
+        std::string group;
+        bool operator==(const CookKey & other) const {
+            return detail == other.detail && meta == other.meta && output == other.output
+                && strength == other.strength && mode == other.mode 
+                && basis == other.basis && stream == other.stream 
+                && frame == other.frame && regularization == other.regularization
+                && variance == other.variance && maxcomponents == other.maxcomponents
+                && profile == other.profile && group == other.group;
+        }
+    };
+
+    /// Projects P - rest onto basis and adds scale * U * weights to P. Basis
+    /// rows follow 'points' (all points, or group members, see
+    /// updateGroupMatrix()). U * weights is kept in m_displacement. With
+    /// normal, U^T * delta is turned into least squares weights before
+    /// reconstruction.
+    bool    projectDisplacement(const SubspaceBasis & basis, const float scale,
+                const PointMap & points, const NormalSolver * normal=nullptr);
+    /// Region file variant of projectDisplacement(): regions project their
+    /// own points, a group only limits which points move.
+    bool    projectRegions(const RegionBasis & regions, const float scale,
+                const PointMap & points);
+    /// Sets P = rest + scale * U * w, with w of the stream frame nearest to
+    /// 'frame'.
+    bool    reconstructFromStream(const SubspaceBasis & basis, const float scale,
+                const fpreal frame, const PointMap & points);
+    /// Gathers (and in ORTHO mode re-orthonormalizes) basis rows of myGroup's
+    /// points, unless group membership didn't change since the last cook.
+    void    updateGroupMatrix(const int deform_mode);
+    /// Factors the Gram matrix of the basis (or group sub-basis) in use
+    /// unless basis, rank, group and regularization are the ones last factored.
+    void    updateNormalSolver(const fpreal regularization);
+    /// First m_rank columns of full: full itself if that's all of them,
+    /// otherwise a zero copy view of them set up in 'prefix'.
+    const SubspaceBasis & truncated(const SubspaceBasis & full, SubspaceBasis & prefix);
+    /// Cancels a pending load and starts loading the basis parameters point
+    /// to on a background thread (or, with background loading off, marks
+    /// it for loading in the next cook).
+    void    startLoad();
+    /// Makes basis the current one if it fits the input, dropping what was
+    /// derived from the previous one. Warns and returns false otherwise.
+    bool    adoptBasis(const BasisHandle & basis);
+    /// Completes m_profile of a cook which started at 'start' and, with
+    /// 'attributes', writes it into gdp's subdeform_* detail attributes.
+    void    finishProfile(const int64 components, const char * path,
+                const ProfileClock::time_point start, const bool attributes);
+
     void    getGroups(UT_String &str)         { evalString(str, "group", 0, 0); }
     void    SUBSPACEMATRIX(UT_String &str)    { evalString(str, "subspacematrix", 0, 0); }
     void    DEFORMMODE(UT_String &str)        { evalString(str, "deformmode", 0, 0); }
     fpreal  STRENGTH(fpreal t)                { return evalFloat("strength", 0, t); }
+    int     PRECISION()                       { return evalInt("precision", 0, 0); }
+    void    WEIGHTSTREAM(UT_String &str)      { evalString(str, "weightstream", 0, 0); }
+    fpreal  WEIGHTFRAME(fpreal t)             { return evalFloat("weightframe", 0, t); }
+    int     PROFILEATTRIBS()                  { return evalInt("profileattribs", 0, 0); }
+    int     BACKGROUNDLOAD()                  { return evalInt("backgroundload", 0, 0); }
+    fpreal  REGULARIZATION(fpreal t)          { return evalFloat("regularization", 0, t); }
+    int     MAXCOMPONENTS(fpreal t)           { return evalInt("maxcomponents", 0, t); }
+    fpreal  VARIANCE(fpreal t)                { return evalFloat("variance", 0, t); }
 
     /// This is the group of geometry to be manipulated by this SOP and cooked
     /// by the method "cookInputGroups".
     const GA_PointGroup *myGroup;
-    Matrix        m_matrix;
-    Matrix        m_transposed;
-    DeltaVector   m_delta;
-    QRMatrixPtr   m_qrmatrix = nullptr;
+    /// Basis (and its thin Q) shared by all nodes using the same file.
+    BasisHandle   m_matrix;
+    /// Background load of the next basis, swapped in by the first cook
+    /// seeing it ready.
+    BasisLoadHandle m_load;
+    /// Components in use (see SubspaceBasis::truncatedRank()) and zero copy
+    /// views of that many leading columns of m_matrix's basis and thin Q.
+    int64         m_rank = 0;
+    SubspaceBasis m_prefix;
+    SubspaceBasis m_orthoprefix;
+    /// Rows of m_matrix for myGroup points (orthonormalized in ORTHO mode),
+    /// of its first m_rank columns.
+    SubspaceBasis m_groupmatrix;
+    PointMap      m_grouppoints;
+    std::vector<int64_t> m_groupindices;
+    uint64_t      m_grouphash = 0;
+    /// U^T * U of m_groupmatrix (LEAST_SQUARES with a group).
+    Matrix        m_groupgram;
+    /// Factored Gram matrix of LEAST_SQUARES mode and what it came from.
+    NormalSolver  m_normal;
+    int           m_normalbasis = -1;
+    int64         m_normalrank  = -1;
+    uint64_t      m_normalgroup = 0;
     DeltaVector   m_weights;
+    DeltaVectorF  m_weights_f;
+    /// Offsets of all gdp points by number, rebuilt when its layout changes.
+    PointMap      m_points;
+    ProjectionEngine<double> m_engine;
+    ProjectionEngine<float>  m_engine_f;
+    /// Unscaled displacement of the last projection and what it came from.
+    Displacement  m_displacement;
+    ProjectionKey m_projkey;
+    CookKey       m_cookkey;
+    /// Bumped whenever m_matrix is (re)acquired.
+    int           m_basisserial = 0;
     bool          m_needs_init = true;
+    /// Per frame weights of RECONSTRUCT mode.
+    WeightStream  m_stream;
+    int           m_streamserial = 0;
+    bool          m_stream_dirty = true;
+    /// Stage timings of the last cook (node info, detail attributes).
+    Profile       m_profile;
 
 };
 
@@ -0,0 +1,349 @@
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <thread>
+#include "basis.hpp"
+
+namespace subdeform {
+
+namespace {
+constexpr int64_t GRAM_RANGES       = 64;   // row ranges with a partial U^T U each
+constexpr int64_t GRAM_BLOCK_POINTS = 1024; // points converted to double at once
+} // end of anonymous namespace
+
+bool SubspaceBasis::open(const char * filename, Precision precision) {
+    close();
+    if (!m_file.open(filename)) {
+        m_error = m_file.error();
+        return false;
+    }
+    init(precision);
+    return true;
+}
+
+bool SubspaceBasis::view(const char * base, size_t size, Precision precision) {
+    close();
+    if (!m_file.view(base, size)) {
+        m_error = m_file.error();
+        return false;
+    }
+    init(precision);
+    return true;
+}
+
+void SubspaceBasis::init(Precision precision) {
+    m_rows      = m_file.rows();
+    m_cols      = m_file.cols();
+    m_precision = precision;
+    m_singular  = m_file.singularValues();
+
+    const DataType dtype = m_file.dtype();
+    if (precision == Precision::Double) {
+        if (dtype == DataType::Float64) {
+            m_data = m_file.payload();
+        } else {
+            m_file.copyTo(m_double);
+            m_data = m_double.data();
+        }
+        m_storage = DataType::Float64;
+    } else {
+        // Float32, Float16 and quantized payloads stay mapped, half is
+        // widened and integers dequantized in registers.
+        if (dtype == DataType::Float64) {
+            m_file.copyTo(m_float);
+            m_data    = m_float.data();
+            m_storage = DataType::Float32;
+        } else {
+            m_data    = m_file.payload();
+            m_storage = dtype;
+            m_scales  = m_file.scales();
+            m_scale_rows = m_file.scaleRows();
+        }
+    }
+    // Converted copies don't need the mapping anymore.
+    if (m_data != m_file.payload())
+        m_file.close();
+}
+
+void SubspaceBasis::assign(const Matrix & matrix, Precision precision) {
+    close();
+    m_rows      = matrix.rows();
+    m_cols      = matrix.cols();
+    m_precision = precision;
+    if (precision == Precision::Double) {
+        m_double  = matrix;
+        m_data    = m_double.data();
+        m_storage = DataType::Float64;
+    } else {
+        m_float   = matrix.cast<float>();
+        m_data    = m_float.data();
+        m_storage = DataType::Float32;
+    }
+}
+
+void SubspaceBasis::orthonormalize() {
+    orthonormalize(*this);
+}
+
+void SubspaceBasis::orthonormalize(const SubspaceBasis & source) {
+    // The only dense copy, factored in place (reflectors overwrite it).
+    Matrix dense;
+    source.toMatrix(dense);
+    const Eigen::HouseholderQR<Eigen::Ref<Matrix> > qr(dense);
+    const Vector singular = source.m_singular;
+    const Precision precision = source.m_precision;
+    close();
+    m_rows      = dense.rows();
+    m_cols      = dense.cols();
+    m_precision = precision;
+    m_singular  = singular;
+    // Apply Householder reflectors to thin identity, never forming full 3N x 3N Q.
+    if (precision == Precision::Double) {
+        m_double.setIdentity(m_rows, m_cols);
+        m_double.applyOnTheLeft(qr.householderQ());
+        m_data    = m_double.data();
+        m_storage = DataType::Float64;
+    } else {
+        Matrix q = Matrix::Identity(m_rows, m_cols);
+        q.applyOnTheLeft(qr.householderQ());
+        m_float   = q.cast<float>();
+        m_data    = m_float.data();
+        m_storage = DataType::Float32;
+    }
+}
+
+namespace {
+template<typename S, typename T>
+void gather_rows(const S * data, int64_t ld, int64_t cols, 
+    const std::vector<int64_t> & points, Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> & out) {
+    const int64_t count = points.size();
+    out.resize(3*count, cols);
+    for (int64_t c = 0; c < cols; ++c) {
+        const S * column = data + c*ld;
+        T * target = out.col(c).data();
+        for (int64_t i = 0; i < count; ++i) {
+            const S * row = column + 3*points[i];
+            target[3*i + 0] = static_cast<T>(row[0]);
+            target[3*i + 1] = static_cast<T>(row[1]);
+            target[3*i + 2] = static_cast<T>(row[2]);
+        }
+    }
+}
+
+template<typename Q, typename T>
+void gather_rows(const QuantizedBasis<Q> & data, int64_t ld, int64_t cols,
+    const std::vector<int64_t> & points, Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> & out) {
+    const int64_t count = points.size();
+    out.resize(3*count, cols);
+    for (int64_t c = 0; c < cols; ++c) {
+        const Q * column = data.data + c*ld;
+        const float * scales = data.scales + c*data.blocks;
+        T * target = out.col(c).data();
+        for (int64_t i = 0; i < count; ++i) {
+            for (int64_t k = 0; k < 3; ++k) {
+                const int64_t row = 3*points[i] + k;
+                target[3*i + k] = static_cast<T>(column[row] * scales[row / data.scale_rows]);
+            }
+        }
+    }
+}
+
+template<typename T>
+void gather_rows(const void * data, DataType storage, int64_t ld, int64_t cols,
+    const float * scales, int64_t scale_rows,
+    const std::vector<int64_t> & points, Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> & out) {
+    const int64_t blocks = scales ? scale_blocks(ld, scale_rows) : 0;
+    switch (storage) {
+        case DataType::Float64:
+            gather_rows(static_cast<const double*>(data), ld, cols, points, out); break;
+        case DataType::Float32:
+            gather_rows(static_cast<const float*>(data), ld, cols, points, out); break;
+        case DataType::Float16:
+            gather_rows(static_cast<const Eigen::half*>(data), ld, cols, points, out); break;
+        case DataType::Int16:
+            gather_rows(QuantizedBasis<int16_t>{static_cast<const int16_t*>(data), scales,
+                scale_rows, blocks, 0}, ld, cols, points, out); break;
+        case DataType::Int8:
+            gather_rows(QuantizedBasis<int8_t>{static_cast<const int8_t*>(data), scales,
+                scale_rows, blocks, 0}, ld, cols, points, out); break;
+    }
+}
+} // end of anonymous namespace
+
+void SubspaceBasis::gatherRows(const SubspaceBasis & source, const std::vector<int64_t> & points) {
+    close();
+    m_rows      = 3*points.size();
+    m_cols      = source.m_cols;
+    m_precision = source.m_precision;
+    m_singular  = source.m_singular;
+    if (m_precision == Precision::Double) {
+        gather_rows(source.m_data, source.m_storage, source.m_rows, m_cols,
+            source.m_scales, source.m_scale_rows, points, m_double);
+        m_data    = m_double.data();
+        m_storage = DataType::Float64;
+    } else {
+        gather_rows(source.m_data, source.m_storage, source.m_rows, m_cols,
+            source.m_scales, source.m_scale_rows, points, m_float);
+        m_data    = m_float.data();
+        m_storage = DataType::Float32;
+    }
+}
+
+void SubspaceBasis::viewColumns(const SubspaceBasis & source, int64_t cols) {
+    close();
+    m_rows       = source.m_rows;
+    m_cols       = std::max<int64_t>(0, std::min(cols, source.m_cols));
+    m_precision  = source.m_precision;
+    m_storage    = source.m_storage;
+    m_fixed      = source.m_fixed;
+    // Quantized scales are stored column by column too.
+    m_data       = source.m_data;
+    m_scales     = source.m_scales;
+    m_scale_rows = source.m_scale_rows;
+    if (source.m_singular.size() >= m_cols)
+        m_singular = source.m_singular.head(m_cols);
+}
+
+int64_t SubspaceBasis::truncatedRank(double variance, int64_t max_cols) const {
+    int64_t rank = m_cols;
+    if (variance < 1 && m_singular.size() >= m_cols) {
+        const double cutoff = variance * m_singular.head(m_cols).squaredNorm();
+        double keep = 0;
+        rank = 0;
+        while (rank < m_cols && keep < cutoff) {
+            keep += m_singular(rank) * m_singular(rank);
+            rank++;
+        }
+    }
+    if (max_cols > 0)
+        rank = std::min(rank, max_cols);
+    return std::max<int64_t>(rank, std::min<int64_t>(m_cols, 1));
+}
+
+void SubspaceBasis::close() {
+    m_file.close();
+    m_double.resize(0, 0);
+    m_float.resize(0, 0);
+    m_singular.resize(0);
+    m_data = nullptr;
+    m_scales = nullptr;
+    m_scale_rows = 0;
+    m_rows = 0;
+    m_cols = 0;
+    m_error.clear();
+}
+
+bool SubspaceBasis::prefetch(const std::function<bool(double)> & progress) const {
+    const char * data = static_cast<const char*>(m_data);
+    const size_t size = m_rows * m_cols * dtype_size(m_storage);
+    volatile char sink = 0;
+    for (size_t offset = 0; offset < size; offset += PREFETCH_CHUNK) {
+        const size_t end = std::min(size, offset + PREFETCH_CHUNK);
+        char touched = 0;
+        for (size_t byte = offset; byte < end; byte += MATRIX_PAGE_SIZE)
+            touched ^= data[byte];
+        sink = sink ^ touched;
+        if (progress && !progress(double(end) / size))
+            return false;
+    }
+    return true;
+}
+
+void SubspaceBasis::gram(Matrix & gram) const {
+    // Fixed row ranges (not per thread) summed in order: same result for
+    // any number of threads.
+    const int64_t npoints = m_rows / 3;
+    const int64_t ranges  = std::min<int64_t>(GRAM_RANGES, 
+        std::max<int64_t>(1, (npoints + GRAM_BLOCK_POINTS - 1) / GRAM_BLOCK_POINTS));
+    std::vector<Matrix> partials(ranges, Matrix::Zero(m_cols, m_cols));
+    std::atomic<int64_t> next(0);
+    auto worker = [&]() {
+        std::vector<int64_t> points;
+        Matrix block;
+        for (int64_t r = next++; r < ranges; r = next++) {
+            const int64_t first = npoints * r / ranges;
+            const int64_t last  = npoints * (r + 1) / ranges;
+            for (int64_t begin = first; begin < last; begin += GRAM_BLOCK_POINTS) {
+                const int64_t end = std::min(last, begin + GRAM_BLOCK_POINTS);
+                points.resize(end - begin);
+                for (int64_t i = begin; i < end; ++i)
+                    points[i - begin] = i;
+                gather_rows(m_data, m_storage, m_rows, m_cols, m_scales, m_scale_rows, points, block);
+                partials[r].selfadjointView<Eigen::Lower>().rankUpdate(block.transpose());
+            }
+        }
+    };
+    const int64_t threads = std::min<int64_t>(ranges, 
+        std::max(1u, std::thread::hardware_concurrency()));
+    std::vector<std::thread> pool;
+    for (int64_t t = 1; t < threads; ++t)
+        pool.emplace_back(worker);
+    worker();
+    for (auto & thread : pool)
+        thread.join();
+
+    gram.setZero(m_cols, m_cols);
+    for (const Matrix & partial : partials)
+        gram += partial;
+    gram = gram.selfadjointView<Eigen::Lower>();
+}
+
+void NormalSolver::factor(const Matrix & gram, double regularization) {
+    m_size           = gram.rows();
+    m_regularization = regularization;
+    const double lambda = m_size ? regularization * gram.diagonal().mean() : 0.0;
+    const Eigen::SelfAdjointEigenSolver<Matrix> eigen(gram + lambda * Matrix::Identity(m_size, m_size));
+    m_vectors = eigen.eigenvectors();
+    // Round-off eigenvalues of dependent shapes would blow weights up.
+    const Vector & values  = eigen.eigenvalues();
+    const double tolerance = m_size 
+        ? m_size * std::numeric_limits<double>::epsilon() * values.cwiseAbs().maxCoeff() : 0.0;
+    m_inverse.resize(m_size);
+    for (int64_t i = 0; i < m_size; ++i)
+        m_inverse(i) = values(i) > tolerance ? 1.0 / values(i) : 0.0;
+}
+
+namespace {
+/// Dense double copy of a quantized basis of rows x cols (scales of a
+/// column are contiguous, so a column prefix view works as is).
+template<typename Q>
+void dequantize_matrix(const QuantizedBasis<Q> & basis, int64_t rows, int64_t cols,
+    Matrix & matrix) {
+    matrix.resize(rows, cols);
+    for (int64_t c = 0; c < cols; ++c) {
+        const Q * column = basis.data + c*rows;
+        const float * scales = basis.scales + c*basis.blocks;
+        for (int64_t b = 0; b < basis.blocks; ++b) {
+            const int64_t first = b * basis.scale_rows;
+            const int64_t count = std::min(basis.scale_rows, rows - first);
+            detail::dequantize(column + first, double(scales[b]), count, &matrix(first, c));
+        }
+    }
+}
+} // end of anonymous namespace
+
+void SubspaceBasis::toMatrix(Matrix & matrix) const {
+    // Decoded from the basis' own data, not the file: views (column
+    // prefixes) share the file's data but not its size.
+    switch (m_storage) {
+        case DataType::Float64:
+            matrix = MatrixMap(static_cast<const double*>(m_data), m_rows, m_cols);
+            break;
+        case DataType::Float32:
+            matrix = Eigen::Map<const MatrixF>(static_cast<const float*>(m_data),
+                m_rows, m_cols).cast<double>();
+            break;
+        case DataType::Float16:
+            matrix = Eigen::Map<const Eigen::Matrix<Eigen::half, Eigen::Dynamic, Eigen::Dynamic> >(
+                static_cast<const Eigen::half*>(m_data), m_rows, m_cols).cast<double>();
+            break;
+        case DataType::Int16:
+            dequantize_matrix(quantized<int16_t>(), m_rows, m_cols, matrix);
+            break;
+        case DataType::Int8:
+            dequantize_matrix(quantized<int8_t>(), m_rows, m_cols, matrix);
+            break;
+    }
+}
+
+} // end of subdeform namespace
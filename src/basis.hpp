@@ -0,0 +1,214 @@
+#pragma once
+#include <functional>
+#include <string>
+#include <vector>
+#include <Eigen/Eigenvalues>
+#include "math.hpp"
+#include "matrix_file.hpp"
+#include "projection.hpp"
+
+namespace subdeform {
+
+/// Bytes touched between SubspaceBasis::prefetch() progress calls.
+constexpr size_t PREFETCH_CHUNK = size_t(64) << 20;
+
+enum class Precision {
+    Double = 0,
+    Single = 1,
+};
+
+/// Runtime subspace basis. Keeps the file mapping whenever kernels can read
+/// its dtype directly (Float64 for Double, Float32/Float16/Int16/Int8 for
+/// Single) and holds a converted copy otherwise.
+class SubspaceBasis
+{
+public:
+    bool open(const char * filename, Precision precision);
+    /// Opens a matrix embedded in memory mapped by someone else (see
+    /// MappedMatrix::view()), which has to outlive this basis.
+    bool view(const char * base, size_t size, Precision precision);
+    /// Takes an in-memory basis (e.g. a derived orthonormal one).
+    void assign(const Matrix & matrix, Precision precision);
+    /// Replaces this basis with its explicit thin Q factor (3N x K, Q^T Q = I).
+    void orthonormalize();
+    /// Replaces this basis with the thin Q factor of source, which may be
+    /// mapped or quantized; decodes it once and factors that copy in place.
+    void orthonormalize(const SubspaceBasis & source);
+    /// Builds a sub-basis from source rows of given points (3 rows per point,
+    /// in 'points' order), kept in source precision.
+    void gatherRows(const SubspaceBasis & source, const std::vector<int64_t> & points);
+    /// Zero copy view of source's first 'cols' columns (columns are stored
+    /// one after another, so a prefix is the same data with fewer of them).
+    /// Source has to outlive the view.
+    void viewColumns(const SubspaceBasis & source, int64_t cols);
+    void close();
+
+    bool        isOpen()    const { return m_data != nullptr; }
+    int64_t     rows()      const { return m_rows; }
+    int64_t     cols()      const { return m_cols; }
+    Precision   precision() const { return m_precision; }
+    /// Data type kernels are reading from (may differ from compute precision).
+    DataType    storage()   const { return m_storage; }
+    const Vector & singularValues() const { return m_singular; }
+    /// Leading columns capturing 'variance' (0..1) of the variance of all
+    /// columns, at most max_cols of them (0: no limit). Bases without
+    /// singular values (raw shapes) aren't in variance order, only max_cols
+    /// applies to them. At least one column.
+    int64_t     truncatedRank(double variance, int64_t max_cols) const;
+    const std::string & error() const { return m_error; }
+    /// Bytes of basis data held by this object (mapped or owned).
+    size_t      memoryUsage() const {
+        return m_rows * m_cols * dtype_size(m_storage)
+            + (m_scales ? m_cols * scale_blocks(m_rows, m_scale_rows) * sizeof(float) : 0);
+    }
+
+    /// weights = U^T * delta
+    template<typename T>
+    void project(const T * delta, T * weights) const;
+    /// out = U * weights
+    template<typename T>
+    void reconstruct(const T * weights, T * out) const;
+    /// weights += U[row:row+count]^T * delta (delta holds 'count' values).
+    template<typename T>
+    void projectRows(int64_t row, int64_t count, const T * delta, T * weights) const;
+    /// out = U[row:row+count] * weights
+    template<typename T>
+    void reconstructRows(int64_t row, int64_t count, const T * weights, T * out) const;
+    /// weights = U^T * delta for 'count' deltas (3N x count, column major)
+    /// with one matrix product, see project_block().
+    template<typename T>
+    void projectBlock(const T * delta, int64_t count, T * weights) const;
+    /// out = U * weights for 'count' weight vectors (K x count).
+    template<typename T>
+    void reconstructBlock(const T * weights, int64_t count, T * out) const;
+    /// Lets project*()/reconstruct*() of single vectors use fixed size
+    /// kernels for 8, 16, 24, 32, 48 and 64 columns (see project_fixed(),
+    /// on by default). Off runs the dynamic ones, e.g. to compare them.
+    void        setFixedKernels(bool enabled) { m_fixed = enabled; }
+    bool        fixedKernels() const { return m_fixed; }
+    /// Dense double copy of the basis (for factorizations).
+    void toMatrix(Matrix & matrix) const;
+    /// K x K Gram matrix U^T * U in double, accumulated over fixed row
+    /// blocks (any storage, no 3N x K copy).
+    void gram(Matrix & gram) const;
+    /// Reads a byte of every page of the basis, so a mapped file is resident
+    /// before kernels run. progress(fraction done) is called every
+    /// PREFETCH_CHUNK bytes; returning false stops (returns false).
+    bool prefetch(const std::function<bool(double)> & progress) const;
+
+private:
+    /// Picks storage for precision once m_file is open.
+    void init(Precision precision);
+    /// Kernel view of Int16/Int8 storage.
+    template<typename Q>
+    QuantizedBasis<Q> quantized() const {
+        return QuantizedBasis<Q>{static_cast<const Q*>(m_data), m_scales, m_scale_rows,
+            scale_blocks(m_rows, m_scale_rows), 0};
+    }
+
+    MappedMatrix m_file;
+    Matrix       m_double;
+    MatrixF      m_float;
+    Vector       m_singular;
+    const void * m_data      = nullptr;
+    const float* m_scales    = nullptr;  // quantized storage only
+    int64_t      m_scale_rows = 0;
+    int64_t      m_rows      = 0;
+    int64_t      m_cols      = 0;
+    Precision    m_precision = Precision::Double;
+    DataType     m_storage   = DataType::Float64;
+    bool         m_fixed     = true;
+    std::string  m_error;
+};
+
+/// Least squares weights for a basis which isn't orthonormal (e.g. raw
+/// shapes):
+///
+///   w = (U^T U + lambda I)^-1 * U^T * delta
+///
+/// from a factored Gram matrix, so a solve costs the U^T * delta GEMV plus
+/// two O(K^2) products. lambda is the Tikhonov 'regularization' times the
+/// mean of U^T U's diagonal, so it doesn't depend on the basis' scale.
+/// Gram matrix is factored as V * E * V^T, eigenvalues below K * eps of the
+/// largest one count as zero (pseudo-inverse): (nearly) duplicated shapes
+/// share their weight instead of getting huge, cancelling ones when lambda
+/// is 0.
+class NormalSolver
+{
+public:
+    void   factor(const Matrix & gram, double regularization);
+    bool   isValid()        const { return m_size > 0; }
+    int64_t size()          const { return m_size; }
+    double regularization() const { return m_regularization; }
+    /// Turns U^T * delta into weights, in place.
+    template<typename T>
+    void solve(T * weights) const { solveBlock(weights, 1); }
+    /// solve() of 'count' weight vectors (K x count, column major).
+    template<typename T>
+    void solveBlock(T * weights, int64_t count) const {
+        using Block = Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>;
+        const Matrix rhs = Eigen::Map<const Block>(weights, m_size, count).template cast<double>();
+        const Matrix projected = m_inverse.asDiagonal() * (m_vectors.transpose() * rhs);
+        Eigen::Map<Block>(weights, m_size, count) = (m_vectors * projected).template cast<T>();
+    }
+
+private:
+    Matrix  m_vectors;   // V
+    Vector  m_inverse;   // 1 / E, 0 for dropped eigenvalues
+    int64_t m_size           = 0;
+    double  m_regularization = 0;
+};
+
+#define SUBSPACE_BASIS_DISPATCH(KERNEL, ...)                                              \
+    switch (m_storage) {                                                                 \
+        case DataType::Float64:                                                          \
+            KERNEL(static_cast<const double*>(m_data) + row, m_rows, __VA_ARGS__); break;      \
+        case DataType::Float32:                                                          \
+            KERNEL(static_cast<const float*>(m_data) + row, m_rows, __VA_ARGS__); break;       \
+        case DataType::Float16:                                                          \
+            KERNEL(static_cast<const Eigen::half*>(m_data) + row, m_rows, __VA_ARGS__); break; \
+        case DataType::Int16:                                                            \
+            KERNEL(quantized<int16_t>() + row, m_rows, __VA_ARGS__); break;                    \
+        case DataType::Int8:                                                             \
+            KERNEL(quantized<int8_t>() + row, m_rows, __VA_ARGS__); break;                     \
+    }
+
+template<typename T>
+void SubspaceBasis::projectRows(int64_t row, int64_t count, const T * delta, T * weights) const {
+    SUBSPACE_BASIS_DISPATCH(subdeform::project_rows, count, m_cols, delta, weights, m_fixed)
+}
+
+template<typename T>
+void SubspaceBasis::reconstructRows(int64_t row, int64_t count, const T * weights, T * out) const {
+    SUBSPACE_BASIS_DISPATCH(subdeform::reconstruct_rows, count, m_cols, weights, out, m_fixed)
+}
+
+template<typename T>
+void SubspaceBasis::project(const T * delta, T * weights) const {
+    for (int64_t c = 0; c < m_cols; ++c)
+        weights[c] = 0;
+    projectRows(0, m_rows, delta, weights);
+}
+
+template<typename T>
+void SubspaceBasis::reconstruct(const T * weights, T * out) const {
+    reconstructRows(0, m_rows, weights, out);
+}
+
+template<typename T>
+void SubspaceBasis::projectBlock(const T * delta, int64_t count, T * weights) const {
+    const int64_t row = 0;
+    for (int64_t i = 0; i < m_cols*count; ++i)
+        weights[i] = 0;
+    SUBSPACE_BASIS_DISPATCH(subdeform::project_block, m_rows, m_cols, delta, count, weights)
+}
+
+template<typename T>
+void SubspaceBasis::reconstructBlock(const T * weights, int64_t count, T * out) const {
+    const int64_t row = 0;
+    SUBSPACE_BASIS_DISPATCH(subdeform::reconstruct_block, m_rows, m_cols, weights, count, out)
+}
+
+#undef SUBSPACE_BASIS_DISPATCH
+
+} // end of subdeform namespace
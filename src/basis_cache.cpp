@@ -0,0 +1,262 @@
+#include <cstdlib>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <stdlib.h>
+#else
+#include <limits.h>
+#endif
+#include "basis_cache.hpp"
+
+namespace subdeform {
+
+namespace {
+/// Canonical path + mtime + size + precision, empty if file doesn't exist.
+std::string cache_key(const char * filename, Precision precision) {
+#ifdef _WIN32
+    char canonical[_MAX_PATH];
+    if (!_fullpath(canonical, filename, _MAX_PATH))
+        return std::string();
+    struct _stat64 st;
+    if (_stat64(canonical, &st) != 0)
+        return std::string();
+#else
+    char canonical[PATH_MAX];
+    if (!realpath(filename, canonical))
+        return std::string();
+    struct stat st;
+    if (stat(canonical, &st) != 0)
+        return std::string();
+#endif
+    return std::string(canonical) + '|' + std::to_string((long long)st.st_mtime)
+        + '|' + std::to_string((long long)st.st_size)
+        + '|' + std::to_string(static_cast<int>(precision));
+}
+} // end of anonymous namespace
+
+const SubspaceBasis & SharedBasis::ortho() const {
+    std::call_once(m_ortho_once, [this]() {
+        if (regional())
+            m_ortho_regions.orthonormalize(m_regions);
+        else
+            m_ortho.orthonormalize(m_basis);
+        m_ortho_ready = true;
+        BasisCache::instance().trim();
+    });
+    return m_ortho;
+}
+
+const Matrix & SharedBasis::gram() const {
+    std::call_once(m_gram_once, [this]() {
+        m_basis.gram(m_gram);
+        m_gram_ready = true;
+        BasisCache::instance().trim();
+    });
+    return m_gram;
+}
+
+const RegionBasis & SharedBasis::orthoRegions() const {
+    ortho();
+    return m_ortho_regions;
+}
+
+size_t SharedBasis::memoryUsage() const {
+    if (regional())
+        return m_regions.memoryUsage() + (m_ortho_ready ? m_ortho_regions.memoryUsage() : 0);
+    return m_basis.memoryUsage() + (m_ortho_ready ? m_ortho.memoryUsage() : 0)
+        + (m_gram_ready ? m_gram.size() * sizeof(double) : 0);
+}
+
+bool SharedBasis::prefetch(const std::function<bool(double)> & progress) const {
+    return regional() ? m_regions.prefetch(progress) : m_basis.prefetch(progress);
+}
+
+BasisCache & BasisCache::instance() {
+    static BasisCache cache;
+    return cache;
+}
+
+BasisCache::BasisCache() : m_budget(size_t(8192) << 20) {
+    if (const char * budget = getenv("SUBDEFORM_CACHE_MB"))
+        m_budget = size_t(atoll(budget)) << 20;
+}
+
+BasisCache::~BasisCache() {
+    // Joined without the lock, loaders still finishing may need the cache.
+    std::list<Loader> loaders;
+    {
+        std::lock_guard<std::mutex> lock(m_loaders_mutex);
+        loaders.swap(m_loaders);
+    }
+    for (Loader & loader : loaders)
+        loader.request->cancel();
+    for (Loader & loader : loaders)
+        loader.thread.join();
+}
+
+BasisHandle BasisCache::acquire(const char * filename, Precision precision,
+    std::string & error) {
+    const std::string key = cache_key(filename, precision);
+    if (key.empty()) {
+        error = "Can't open file.";
+        return nullptr;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (auto it = m_entries.begin(); it != m_entries.end(); ++it) {
+            if (it->key == key) {
+                m_entries.splice(m_entries.begin(), m_entries, it);
+                return m_entries.front().shared;
+            }
+        }
+    }
+    // Loading doesn't hold the lock, so other files keep being served.
+    auto shared = std::make_shared<SharedBasis>();
+    if (is_region_basis(filename)) {
+        if (!shared->m_regions.open(filename, precision)) {
+            error = shared->m_regions.error();
+            return nullptr;
+        }
+    } else if (!shared->m_basis.open(filename, precision)) {
+        error = shared->m_basis.error();
+        return nullptr;
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (auto it = m_entries.begin(); it != m_entries.end(); ++it) {
+        // Someone else loaded it meanwhile, use theirs.
+        if (it->key == key) {
+            m_entries.splice(m_entries.begin(), m_entries, it);
+            return m_entries.front().shared;
+        }
+    }
+    m_entries.push_front(Entry{key, shared});
+    evict();
+    return shared;
+}
+
+BasisLoadHandle BasisCache::load(const char * filename, Precision precision, bool ortho,
+    bool gram) {
+    BasisLoadHandle request(new BasisLoad(filename, precision, ortho, gram));
+    std::lock_guard<std::mutex> lock(m_loaders_mutex);
+    // Reaps loaders which are done, only the pending ones are kept.
+    for (auto it = m_loaders.begin(); it != m_loaders.end(); ) {
+        if (it->request->m_finished) {
+            it->thread.join();
+            it = m_loaders.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    // The thread owns a reference, so an abandoned request just runs to
+    // its next checkpoint.
+    m_loaders.push_back(Loader{request, std::thread([request]() {
+        request->run();
+        request->m_finished = true;
+    })});
+    return request;
+}
+
+BasisHandle BasisLoad::result() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_result;
+}
+
+std::string BasisLoad::error() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_error;
+}
+
+bool BasisLoad::checkpoint(float progress) {
+    m_progress = progress;
+    if (!m_cancelled)
+        return true;
+    finish(State::Cancelled, nullptr, std::string());
+    return false;
+}
+
+void BasisLoad::finish(State state, const BasisHandle & result, const std::string & error) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_result = result;
+        m_error  = error;
+    }
+    // Published last, readers seeing Ready see the result.
+    m_state = state;
+}
+
+void BasisLoad::run() {
+    if (!checkpoint(0))
+        return;
+    std::string error;
+    // Cached even if cancelled meanwhile, switching back is then a hit.
+    const BasisHandle shared = BasisCache::instance().acquire(m_filename.c_str(), m_precision, error);
+    if (!shared) {
+        finish(State::Failed, nullptr, error);
+        return;
+    }
+    const float prefetched = m_ortho || m_gram ? 0.6f : 1.0f;
+    if (!checkpoint(0.1f))
+        return;
+    const bool prefetch = shared->prefetch([&](double done) {
+        return checkpoint(0.1f + float(done) * (prefetched - 0.1f));
+    });
+    if (!prefetch)
+        return;
+    if (m_ortho) {
+        shared->ortho();
+        if (!checkpoint(m_gram ? 0.8f : 1.0f))
+            return;
+    }
+    // Regions are PCA bases, they don't need one.
+    if (m_gram && !shared->regional()) {
+        shared->gram();
+        if (!checkpoint(1.0f))
+            return;
+    }
+    finish(State::Ready, shared, std::string());
+}
+
+void BasisCache::trim() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    evict();
+}
+
+void BasisCache::setBudget(size_t bytes) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_budget = bytes;
+    evict();
+}
+
+size_t BasisCache::budget() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_budget;
+}
+
+size_t BasisCache::usage() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return usageLocked();
+}
+
+void BasisCache::purge() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_entries.remove_if([](const Entry & entry) { return entry.shared.use_count() == 1; });
+}
+
+size_t BasisCache::usageLocked() const {
+    size_t total = 0;
+    for (const Entry & entry : m_entries)
+        total += entry.shared->memoryUsage();
+    return total;
+}
+
+void BasisCache::evict() {
+    size_t total = usageLocked();
+    for (auto it = m_entries.end(); it != m_entries.begin() && total > m_budget; ) {
+        --it;
+        if (it->shared.use_count() == 1) {
+            total -= it->shared->memoryUsage();
+            it = m_entries.erase(it);
+        }
+    }
+}
+
+} // end of subdeform namespace
@@ -0,0 +1,150 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "basis.hpp"
+#include "region_basis.hpp"
+
+namespace subdeform {
+
+/// Basis shared between nodes together with products derived from it.
+/// Read only once published by BasisCache; derived products are built
+/// lazily, once, by whichever cook asks first.
+class SharedBasis
+{
+public:
+    const SubspaceBasis & basis() const { return m_basis; }
+    /// Thin Q of basis() (see SubspaceBasis::orthonormalize()).
+    const SubspaceBasis & ortho() const;
+    /// U^T * U of basis() for least squares weights (see NormalSolver).
+    const Matrix & gram() const;
+    /// Region files (see region_basis.hpp) are held here, basis() stays empty.
+    bool regional() const { return m_regions.isOpen(); }
+    const RegionBasis & regions() const { return m_regions; }
+    /// Thin Q of every region.
+    const RegionBasis & orthoRegions() const;
+    /// Points of the mesh the basis belongs to.
+    int64_t points() const { return regional() ? m_regions.points() : m_basis.rows() / 3; }
+    /// Bytes held by basis and derived products built so far.
+    size_t memoryUsage() const;
+    /// SubspaceBasis::prefetch() of the basis (or of all regions).
+    bool prefetch(const std::function<bool(double)> & progress) const;
+
+private:
+    friend class BasisCache;
+    SubspaceBasis          m_basis;
+    mutable SubspaceBasis  m_ortho;
+    mutable std::once_flag m_ortho_once;
+    mutable std::atomic<bool> m_ortho_ready{false};
+    mutable Matrix         m_gram;
+    mutable std::once_flag m_gram_once;
+    mutable std::atomic<bool> m_gram_ready{false};
+    RegionBasis            m_regions;
+    mutable RegionBasis    m_ortho_regions;
+};
+
+using BasisHandle = std::shared_ptr<const SharedBasis>;
+
+/// Background BasisCache::acquire() started by BasisCache::load(). The
+/// loader thread only publishes state() and progress(), which the
+/// requester polls from its own thread; a cancelled (superseded) load
+/// stops at its next checkpoint and is never reported Ready.
+class BasisLoad
+{
+public:
+    enum class State { Loading, Ready, Failed, Cancelled };
+
+    State       state()     const { return m_state; }
+    /// Coarse 0..1 (open, page prefetch, thin Q or Gram matrix).
+    float       progress()  const { return m_progress; }
+    /// Loaded basis, set once state() is Ready.
+    BasisHandle result()    const;
+    std::string error()     const;
+    const std::string & filename() const { return m_filename; }
+    Precision   precision() const { return m_precision; }
+    bool        ortho()     const { return m_ortho; }
+    bool        gram()      const { return m_gram; }
+    void        cancel()          { m_cancelled = true; }
+
+private:
+    friend class BasisCache;
+    BasisLoad(const char * filename, Precision precision, bool ortho, bool gram)
+        : m_filename(filename), m_precision(precision), m_ortho(ortho), m_gram(gram) {}
+    void run();
+    bool checkpoint(float progress);
+    void finish(State state, const BasisHandle & result, const std::string & error);
+
+    const std::string  m_filename;
+    const Precision    m_precision;
+    const bool         m_ortho;
+    const bool         m_gram;
+    std::atomic<State> m_state{State::Loading};
+    std::atomic<float> m_progress{0};
+    std::atomic<bool>  m_cancelled{false};
+    std::atomic<bool>  m_finished{false}; // run() returned, thread can be joined
+    mutable std::mutex m_mutex;
+    BasisHandle        m_result;
+    std::string        m_error;
+};
+
+using BasisLoadHandle = std::shared_ptr<BasisLoad>;
+
+/// Process wide registry of loaded bases keyed by canonical path, mtime,
+/// file size and precision. Nodes referencing the same file share one
+/// basis. Entries no node references anymore are kept for reuse and
+/// evicted in LRU order once total memory exceeds the budget (set with
+/// $SUBDEFORM_CACHE_MB or setBudget()).
+class BasisCache
+{
+public:
+    static BasisCache & instance();
+
+    /// Returns shared basis for a file, loading it on a miss.
+    BasisHandle acquire(const char * filename, Precision precision, std::string & error);
+    /// acquire() on a background thread, which also faults in the basis'
+    /// pages and with 'ortho' builds its thin Q ('gram': its Gram matrix),
+    /// so the cook picking up the result doesn't stall on either.
+    BasisLoadHandle load(const char * filename, Precision precision, bool ortho,
+        bool gram=false);
+    void   setBudget(size_t bytes);
+    size_t budget() const;
+    /// Bytes held by all cached entries (referenced or not).
+    size_t usage() const;
+    /// Drops all entries no node references.
+    void   purge();
+
+private:
+    friend class SharedBasis;
+    struct Entry {
+        std::string key;
+        std::shared_ptr<SharedBasis> shared;
+    };
+    struct Loader {
+        BasisLoadHandle request;
+        std::thread     thread;
+    };
+    BasisCache();
+    /// Cancels pending loads and joins their threads, so none is left
+    /// running into the cache (or a basis) while statics are destroyed.
+    ~BasisCache();
+    /// evict() once a SharedBasis grew by a derived product, which counts
+    /// against the budget too.
+    void   trim();
+    /// Evicts unreferenced entries (LRU first) until usage fits budget.
+    void   evict();
+    size_t usageLocked() const;
+
+    mutable std::mutex m_mutex;
+    std::list<Entry>   m_entries; // most recently used first
+    size_t             m_budget;
+    /// Threads of load(), joined by the next load() once finished.
+    std::mutex         m_loaders_mutex;
+    std::list<Loader>  m_loaders;
+};
+
+} // end of subdeform namespace
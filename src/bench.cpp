@@ -0,0 +1,285 @@
+// Micro/macro benchmarks of the Houdini independent math (subdeform_math).
+// Each measurement prints one JSON object per line:
+//
+//   {"bench": "project", "dtype": "float", "points": 100000, "components": 64,
+//    "reps": 10, "p50_ms": ..., "p90_ms": ..., "p99_ms": ..., "gflops": ..., "gbs": ...}
+//
+// so results can be collected and compared between builds without Houdini.
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "math.hpp"
+#include "matrix_file.hpp"
+#include "basis.hpp"
+#include "psd.hpp"
+
+using namespace subdeform;
+
+namespace {
+
+struct Options {
+    std::vector<int64_t> points     = {10000, 100000, 1000000};
+    std::vector<int64_t> components = {8, 16, 32, 64, 128, 256, 512, 1024};
+    std::vector<std::string> suites = {"kernels", "ortho", "pca", "io", "psd"};
+    int     reps   = 10;
+    int64_t max_mb = 2048;
+    std::string tmp = "subdeform_bench.matrix";
+};
+
+std::vector<int64_t> parse_list(const char * arg) {
+    std::vector<int64_t> values;
+    std::stringstream stream(arg);
+    std::string item;
+    while (std::getline(stream, item, ','))
+        values.push_back(atoll(item.c_str()));
+    return values;
+}
+
+bool has_suite(const Options & options, const char * suite) {
+    return std::find(options.suites.begin(), options.suites.end(), suite) != options.suites.end();
+}
+
+/// Runs fn 'reps' times (after one warm up) and prints latency percentiles
+/// with throughput derived from flops/bytes per run.
+void measure(const Options & options, const char * bench, const char * dtype,
+    int64_t points, int64_t components, double flops, double bytes,
+    const std::function<void()> & fn, int reps=0) {
+    reps = reps ? reps : options.reps;
+    fn();
+    std::vector<double> times;
+    for (int i = 0; i < reps; ++i) {
+        const auto start = std::chrono::steady_clock::now();
+        fn();
+        const auto end = std::chrono::steady_clock::now();
+        times.push_back(std::chrono::duration<double, std::milli>(end - start).count());
+    }
+    std::sort(times.begin(), times.end());
+    auto percentile = [&](double p) {
+        return times[std::min<size_t>(times.size() - 1, p * times.size())];
+    };
+    const double p50 = percentile(0.5);
+    printf("{\"bench\": \"%s\", \"dtype\": \"%s\", \"points\": %lld, \"components\": %lld, "
+        "\"reps\": %d, \"p50_ms\": %.4f, \"p90_ms\": %.4f, \"p99_ms\": %.4f, "
+        "\"gflops\": %.3f, \"gbs\": %.3f}\n",
+        bench, dtype, (long long)points, (long long)components, reps,
+        p50, percentile(0.9), percentile(0.99),
+        flops / (p50 * 1e6), bytes / (p50 * 1e6));
+    fflush(stdout);
+}
+
+/// Frames per GEMM in block projection benchmarks (subdeform project --block).
+const int64_t PROJECT_FRAMES = 32;
+
+void bench_kernels(const Options & options, int64_t points, int64_t components) {
+    const int64_t rows = 3 * points;
+    const Matrix basis = Matrix::Random(rows, components);
+    if (!write_matrix(basis, options.tmp.c_str(), nullptr, DataType::Float32))
+        return;
+    write_matrix(basis, (options.tmp + ".half").c_str(), nullptr, DataType::Float16);
+    write_matrix(basis, (options.tmp + ".int16").c_str(), nullptr, DataType::Int16);
+    write_matrix(basis, (options.tmp + ".int8").c_str(), nullptr, DataType::Int8);
+    struct Config { const char * name; const std::string file; Precision precision; };
+    const Config configs[] = {
+        {"double", options.tmp,           Precision::Double},
+        {"float",  options.tmp,           Precision::Single},
+        {"half",   options.tmp + ".half", Precision::Single},
+        {"int16",  options.tmp + ".int16", Precision::Single},
+        {"int8",   options.tmp + ".int8", Precision::Single},
+    };
+    for (const Config & config : configs) {
+        SubspaceBasis subspace;
+        if (!subspace.open(config.file.c_str(), config.precision))
+            continue;
+        const double flops = 2.0 * rows * components;
+        const double bytes = double(rows) * components * dtype_size(subspace.storage());
+        // Fixed size kernels (where they apply) against the dynamic ones.
+        const bool same_type = subspace.storage() == DataType::Float64 
+            || subspace.storage() == DataType::Float32;
+        for (const bool fixed : {true, false}) {
+            if (!fixed && !(same_type && has_fixed_kernels(components)))
+                break;
+            subspace.setFixedKernels(fixed);
+            const std::string project_name     = fixed ? "project" : "project_dynamic";
+            const std::string reconstruct_name = fixed ? "reconstruct" : "reconstruct_dynamic";
+            if (config.precision == Precision::Double) {
+                Vector delta = Vector::Random(rows), weights(components), out(rows);
+                measure(options, project_name.c_str(), config.name, points, components, flops, 
+                    bytes, [&]() { subspace.project(delta.data(), weights.data()); });
+                measure(options, reconstruct_name.c_str(), config.name, points, components, flops, 
+                    bytes, [&]() { subspace.reconstruct(weights.data(), out.data()); });
+            } else {
+                VectorF delta = VectorF::Random(rows), weights(components), out(rows);
+                measure(options, project_name.c_str(), config.name, points, components, flops, 
+                    bytes, [&]() { subspace.project(delta.data(), weights.data()); });
+                measure(options, reconstruct_name.c_str(), config.name, points, components, flops, 
+                    bytes, [&]() { subspace.reconstruct(weights.data(), out.data()); });
+            }
+        }
+        subspace.setFixedKernels(true);
+        // Same basis traffic for PROJECT_FRAMES deltas at once.
+        const int64_t frames = PROJECT_FRAMES;
+        if (config.precision == Precision::Double) {
+            Matrix delta = Matrix::Random(rows, frames), weights(components, frames);
+            measure(options, "project_block", config.name, points, components, flops * frames, 
+                bytes, [&]() { subspace.projectBlock(delta.data(), frames, weights.data()); });
+        } else {
+            MatrixF delta = MatrixF::Random(rows, frames), weights(components, frames);
+            measure(options, "project_block", config.name, points, components, flops * frames, 
+                bytes, [&]() { subspace.projectBlock(delta.data(), frames, weights.data()); });
+        }
+    }
+    remove((options.tmp + ".half").c_str());
+    remove((options.tmp + ".int16").c_str());
+    remove((options.tmp + ".int8").c_str());
+}
+
+void bench_ortho(const Options & options, int64_t points, int64_t components) {
+    const Matrix basis = Matrix::Random(3 * points, components);
+    Matrix work;
+    const double flops = 4.0 * 3 * points * components * components / 2;
+    const double bytes = 3.0 * points * components * components / 2 * sizeof(double);
+    measure(options, "orthogonalize", "double", points, components, flops, bytes,
+        [&]() { work = basis; orthogonalize_matrix(work, 0); }, std::min(options.reps, 3));
+    // Least squares alternative: U^T U once per basis, then a K x K factor.
+    SubspaceBasis subspace;
+    subspace.assign(basis, Precision::Double);
+    Matrix gram;
+    measure(options, "gram", "double", points, components, 
+        2.0 * 3 * points * components * components / 2, 3.0 * points * components * sizeof(double),
+        [&]() { subspace.gram(gram); }, std::min(options.reps, 3));
+    NormalSolver normal;
+    measure(options, "normal_factor", "double", points, components, 
+        double(components) * components * components / 3, double(components) * components * sizeof(double),
+        [&]() { normal.factor(gram, 0.0); });
+    Vector weights = Vector::Random(components);
+    measure(options, "normal_solve", "double", points, components,
+        2.0 * components * components, double(components) * components * sizeof(double),
+        [&]() { normal.solve(weights.data()); });
+}
+
+void bench_pca(const Options & options, int64_t points, int64_t components) {
+    // Shapes are 4x the kept rank, low rank signal plus noise.
+    const int64_t shapes = std::min<int64_t>(4 * components, 3 * points);
+    const Matrix data = Matrix::Random(3 * points, components) * Matrix::Random(components, shapes)
+        + 1e-3 * Matrix::Random(3 * points, shapes);
+    struct Config { const char * name; PCASolver solver; };
+    const Config configs[] = {
+        {"gram", PCASolver::Gram}, {"randomized", PCASolver::Randomized}, {"jacobi", PCASolver::Jacobi},
+    };
+    for (const Config & config : configs) {
+        // Jacobi is only affordable for small problems.
+        if (config.solver == PCASolver::Jacobi && 3 * points * shapes > 3000000)
+            continue;
+        Matrix work, pca;
+        const double flops = 2.0 * 3 * points * shapes * shapes;
+        const double bytes = 3.0 * points * shapes * sizeof(double);
+        measure(options, (std::string("pca_") + config.name).c_str(), "double", points,
+            components, flops, bytes, [&]() {
+                work = data;
+                computePCA(work, pca, 0.99, false, false, nullptr, config.solver);
+            }, std::min(options.reps, 3));
+    }
+}
+
+void bench_io(const Options & options, int64_t points, int64_t components) {
+    const Matrix basis = Matrix::Random(3 * points, components);
+    const double bytes = double(basis.size()) * sizeof(double);
+    measure(options, "write_matrix", "double", points, components, 0, bytes,
+        [&]() { write_matrix(basis, options.tmp.c_str()); }, std::min(options.reps, 3));
+    // Mapping plus a full checksum pass touches every page.
+    measure(options, "open_verify", "double", points, components, 0, bytes,
+        [&]() { MappedMatrix mapped; mapped.open(options.tmp.c_str(), true); });
+    Matrix copy;
+    measure(options, "read_matrix", "double", points, components, 0, bytes,
+        [&]() { read_matrix(options.tmp.c_str(), copy); });
+}
+
+void bench_psd(const Options & options, int64_t points) {
+    TangentFrames rest, skin;
+    rest.resize(points);
+    skin.resize(points);
+    std::vector<float> delta[3];
+    for (int axis = 0; axis < 3; ++axis) {
+        Eigen::Map<VectorF>(rest.u[axis].data(), points) = VectorF::Random(points);
+        Eigen::Map<VectorF>(rest.v[axis].data(), points) = VectorF::Random(points);
+        Eigen::Map<VectorF>(skin.u[axis].data(), points) = VectorF::Random(points);
+        Eigen::Map<VectorF>(skin.v[axis].data(), points) = VectorF::Random(points);
+        delta[axis].assign(points, 1.f);
+    }
+    rest.normalize();
+    const float * rest_u[3] = {rest.u[0].data(), rest.u[1].data(), rest.u[2].data()};
+    const float * rest_v[3] = {rest.v[0].data(), rest.v[1].data(), rest.v[2].data()};
+    const float * skin_u[3] = {skin.u[0].data(), skin.u[1].data(), skin.u[2].data()};
+    const float * skin_v[3] = {skin.v[0].data(), skin.v[1].data(), skin.v[2].data()};
+    float * deltas[3]       = {delta[0].data(), delta[1].data(), delta[2].data()};
+    // Roughly 100 flops, 12 floats read and 3 written per point.
+    measure(options, "psd_rotate", "float", points, 0, 100.0 * points, 15.0 * 4 * points,
+        [&]() { rotate_to_rest(points, rest_u, rest_v, skin_u, skin_v, deltas); });
+}
+
+} // end of anonymous namespace
+
+int main(int argc, char *argv[])
+{
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        const char * arg  = argv[i];
+        const char * next = i + 1 < argc ? argv[i + 1] : nullptr;
+        if (!strcmp(arg, "--points") && next) {
+            options.points = parse_list(argv[++i]);
+        } else if (!strcmp(arg, "--components") && next) {
+            options.components = parse_list(argv[++i]);
+        } else if (!strcmp(arg, "--reps") && next) {
+            options.reps = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(arg, "--max-mb") && next) {
+            options.max_mb = atoll(argv[++i]);
+        } else if (!strcmp(arg, "--tmp") && next) {
+            options.tmp = argv[++i];
+        } else if (!strcmp(arg, "--suite") && next) {
+            options.suites.clear();
+            std::stringstream stream(argv[++i]);
+            std::string item;
+            while (std::getline(stream, item, ','))
+                options.suites.push_back(item);
+        } else {
+            std::cout << "subdeform_bench options:\n"
+                "  --points 10000,100000,1000000      point counts (N)\n"
+                "  --components 8,16,...,1024         subspace sizes (K)\n"
+                "  --suite kernels,ortho,pca,io,psd   benchmarks to run\n"
+                "  --reps 10                          timed repetitions\n"
+                "  --max-mb 2048                      skip configs with larger basis\n"
+                "  --tmp subdeform_bench.matrix       scratch file for io benchmarks\n";
+            return !strcmp(arg, "--help") ? 0 : 1;
+        }
+    }
+
+    for (const int64_t points : options.points) {
+        if (has_suite(options, "psd"))
+            bench_psd(options, points);
+        for (const int64_t components : options.components) {
+            const int64_t mb = 3 * points * components * sizeof(double) >> 20;
+            if (mb > options.max_mb) {
+                std::cerr << "Skipping N=" << points << " K=" << components
+                          << " (" << mb << "MB > --max-mb)\n";
+                continue;
+            }
+            if (has_suite(options, "kernels"))
+                bench_kernels(options, points, components);
+            if (has_suite(options, "ortho") && components <= 256)
+                bench_ortho(options, points, components);
+            if (has_suite(options, "pca") && points <= 100000 && components <= 256)
+                bench_pca(options, points, components);
+            if (has_suite(options, "io"))
+                bench_io(options, points, components);
+        }
+    }
+    remove(options.tmp.c_str());
+    return 0;
+}
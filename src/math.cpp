@@ -1,12 +1,84 @@
+#include <atomic>
+#include <limits>
+#include <random>
+#include <thread>
+#include <vector>
+#include <Eigen/Eigenvalues>
 #include "math.hpp"
 
 namespace subdeform {
 
 
-void orthogonalize_matrix(Matrix & matrix, int c) {
-    if(c >= matrix.cols())
-      return;
-    for (int x = c; x < matrix.cols(); ++x) {
+namespace {
+
+constexpr int     ORTHO_PANEL     = 64;   // columns orthonormalized together
+constexpr int64_t ORTHO_ROW_BLOCK = 8192; // rows per parallel task
+
+// Calls fn(first_row, row_count, block) for fixed row blocks on all cores.
+// Blocks don't depend on thread count, so results are reproducible.
+template<typename Fn>
+void parallel_row_blocks(int64_t rows, const Fn & fn) {
+    const int64_t blocks  = (rows + ORTHO_ROW_BLOCK - 1) / ORTHO_ROW_BLOCK;
+    const int64_t threads = std::min<int64_t>(blocks, 
+        std::max(1u, std::thread::hardware_concurrency()));
+    if (threads <= 1) {
+        for (int64_t b = 0; b < blocks; ++b)
+            fn(b * ORTHO_ROW_BLOCK, std::min(ORTHO_ROW_BLOCK, rows - b * ORTHO_ROW_BLOCK), b);
+        return;
+    }
+    std::atomic<int64_t> next(0);
+    std::vector<std::thread> pool;
+    for (int64_t t = 0; t < threads; ++t) {
+        pool.emplace_back([&]() {
+            for (int64_t b = next++; b < blocks; b = next++)
+                fn(b * ORTHO_ROW_BLOCK, std::min(ORTHO_ROW_BLOCK, rows - b * ORTHO_ROW_BLOCK), b);
+        });
+    }
+    for (auto & thread : pool)
+        thread.join();
+}
+
+// a^T * b, row block partials summed in block order.
+Matrix blocked_inner(const Eigen::Ref<const Matrix> & a, const Eigen::Ref<const Matrix> & b) {
+    const int64_t blocks = (a.rows() + ORTHO_ROW_BLOCK - 1) / ORTHO_ROW_BLOCK;
+    std::vector<Matrix> partials(blocks);
+    parallel_row_blocks(a.rows(), [&](int64_t first, int64_t count, int64_t block) {
+        partials[block].noalias() = a.middleRows(first, count).transpose() * b.middleRows(first, count);
+    });
+    Matrix result = Matrix::Zero(a.cols(), b.cols());
+    for (const Matrix & partial : partials)
+        result += partial;
+    return result;
+}
+
+// panel -= basis * (basis^T * panel)
+void project_out(Eigen::Ref<Matrix> panel, const Eigen::Ref<const Matrix> & basis) {
+    const Matrix coeffs = blocked_inner(basis, panel);
+    parallel_row_blocks(panel.rows(), [&](int64_t first, int64_t count, int64_t) {
+        panel.middleRows(first, count).noalias() -= basis.middleRows(first, count) * coeffs;
+    });
+}
+
+// One CholeskyQR pass: panel = panel * R^-1 with R^T R = panel^T panel.
+// Fails (leaving panel untouched) when panel is (nearly) rank deficient.
+bool cholesky_qr(Eigen::Ref<Matrix> panel) {
+    const Eigen::LLT<Matrix> llt(blocked_inner(panel, panel));
+    if (llt.info() != Eigen::Success)
+        return false;
+    const Vector diagonal = llt.matrixLLT().diagonal();
+    if (diagonal.minCoeff() < 1e-6 || diagonal.minCoeff() < 1e-7 * diagonal.maxCoeff())
+        return false;
+    const Matrix r = llt.matrixU();
+    parallel_row_blocks(panel.rows(), [&](int64_t first, int64_t count, int64_t) {
+        r.triangularView<Eigen::Upper>().solveInPlace<Eigen::OnTheRight>(
+            panel.middleRows(first, count));
+    });
+    return true;
+}
+
+// Classical column by column Gram-Schmidt of columns [first, last).
+void gram_schmidt(Matrix & matrix, int first, int last) {
+    for (int x = first; x < last; ++x) {
         // project out other components
         for (int y = 0; y < x; ++y) {
             double dot = matrix.col(y).dot(matrix.col(x));
@@ -21,10 +93,105 @@ void orthogonalize_matrix(Matrix & matrix, int c) {
     }
 }
 
+} // end of anonymous namespace
+
+void orthogonalize_matrix(Matrix & matrix, int c) {
+    if(c >= matrix.cols())
+      return;
+    // Block Gram-Schmidt over panels, each panel orthonormalized by CholeskyQR2.
+    for (int first = c; first < matrix.cols(); first += ORTHO_PANEL) {
+        const int width = std::min<int>(ORTHO_PANEL, matrix.cols() - first);
+        auto panel = matrix.middleCols(first, width);
+        // Twice is enough (BCGS2), once loses orthogonality like classical GS.
+        for (int pass = 0; pass < 2 && first > 0; ++pass)
+            project_out(panel, matrix.leftCols(first));
+        // Rank deficient panels fall back to column by column path which
+        // zeroes dependent columns.
+        if (!cholesky_qr(panel) || !cholesky_qr(panel))
+            gram_schmidt(matrix, first, first + width);
+    }
+}
+
+namespace {
+
+// Left singular vectors/values of matrix from eigen decomposition of its
+// Gram matrix. Only S x S work besides two 3N x S products.
+void gram_svd(const Matrix & matrix, Matrix & u, Vector & singular) {
+    const int cols = matrix.cols();
+    Matrix gram = Matrix::Zero(cols, cols);
+    gram.selfadjointView<Eigen::Lower>().rankUpdate(matrix.transpose());
+    Eigen::SelfAdjointEigenSolver<Matrix> eigen(gram);
+    // Eigen returns ascending order.
+    const Vector values = eigen.eigenvalues().reverse().cwiseMax(0.0);
+    const Matrix vectors = eigen.eigenvectors().rowwise().reverse();
+    singular = values.cwiseSqrt();
+    // Squaring the condition number leaves eigenvalues below eps * s0^2 as
+    // noise, their vectors wouldn't come out orthonormal.
+    const double eps = singular.size() 
+        ? singular(0) * std::sqrt(std::numeric_limits<double>::epsilon()) : 0.0;
+    int rank = 0;
+    while (rank < singular.size() && singular(rank) > eps)
+        rank++;
+    singular.conservativeResize(rank);
+    u = matrix * vectors.leftCols(rank);
+    for (int i = 0; i < rank; ++i)
+        u.col(i) /= singular(i);
+}
+
+// Randomized range finder with power iterations. Rank doubles until kept
+// singular values capture 'variance' of the Frobenius norm (which is known
+// without any decomposition). Once it would sample all columns it's no
+// cheaper than the exact SVD, which is used instead.
+void randomized_svd(const Matrix & matrix, double variance, Matrix & u, Vector & singular) {
+    constexpr int power_iterations = 2;
+    constexpr int oversampling     = 8;
+    const int cols     = matrix.cols();
+    const double total = matrix.squaredNorm();
+    int rank = std::min(32, cols);
+    while (true) {
+        const int sample = std::min(rank + oversampling, cols);
+        if (sample == cols) {
+            Eigen::JacobiSVD<Matrix> svd(matrix, Eigen::ComputeThinU);
+            u        = svd.matrixU();
+            singular = svd.singularValues();
+            return;
+        }
+        // Fixed seed keeps results reproducible without touching std::rand().
+        std::mt19937 generator(1);
+        std::uniform_real_distribution<double> uniform(-1.0, 1.0);
+        const Matrix omega = Matrix::NullaryExpr(cols, sample, [&]() { return uniform(generator); });
+        Matrix q = matrix * omega;
+        for (int i = 0; i < power_iterations; ++i) {
+            q = Eigen::HouseholderQR<Matrix>(q).householderQ() * Matrix::Identity(q.rows(), sample);
+            q = matrix * (matrix.transpose() * q);
+        }
+        q = Eigen::HouseholderQR<Matrix>(q).householderQ() * Matrix::Identity(q.rows(), sample);
+        const Matrix b = q.transpose() * matrix;
+        Eigen::JacobiSVD<Matrix> svd(b, Eigen::ComputeThinU);
+        const Vector & values = svd.singularValues();
+        double captured = 0;
+        int keep = 0;
+        while (keep < rank && captured < variance * total) {
+            captured += values(keep) * values(keep);
+            keep++;
+        }
+        if (captured >= variance * total) {
+            u = q * svd.matrixU().leftCols(keep);
+            singular = values.head(keep);
+            return;
+        }
+        rank = std::min(2 * rank, cols);
+    }
+}
+
+} // end of anonymous namespace
+
 bool computePCA(Matrix & matrix, Matrix & pcamatrix, 
-    double variance, bool shift, bool orthogonalize) {
+    double variance, bool shift, bool orthogonalize, Vector * singular_values,
+    PCASolver solver) {
 
     Vector eigenvalues;
+    Vector singularValues;
     const int rows = matrix.rows();
     const int cols = matrix.cols();
 
@@ -36,15 +203,22 @@ bool computePCA(Matrix & matrix, Matrix & pcamatrix,
         matrix *= 1.0 / sqrt(cols - 1);
     }
 
-    Eigen::JacobiSVD<Matrix> eigenSystem(matrix, Eigen::ComputeThinU);
-    const Vector & singularValues = eigenSystem.singularValues();
-    pcamatrix = eigenSystem.matrixU();
+    if (solver == PCASolver::Gram) {
+        gram_svd(matrix, pcamatrix, singularValues);
+    } else if (solver == PCASolver::Randomized) {
+        randomized_svd(matrix, variance, pcamatrix, singularValues);
+    } else {
+        Eigen::JacobiSVD<Matrix> eigenSystem(matrix, Eigen::ComputeThinU);
+        singularValues = eigenSystem.singularValues();
+        pcamatrix = eigenSystem.matrixU();
+    }
     eigenvalues.resize(pcamatrix.cols());
     for(int x = 0; x < pcamatrix.cols(); x++) {
         eigenvalues[x] = singularValues[x] * singularValues[x];
     }
 
-    double sum_   = eigenvalues.sum();
+    // Truncated solvers don't see the tail, total comes from Frobenius norm.
+    double sum_   = solver == PCASolver::Randomized ? matrix.squaredNorm() : eigenvalues.sum();
     double cutoff = variance * sum_;
     double keep_ = 0;
     int pcarank  = 0;
@@ -60,47 +234,90 @@ bool computePCA(Matrix & matrix, Matrix & pcamatrix,
         pcamatrix.conservativeResize(pcamatrix.rows(), pcarank);
     }
 
+    if (singular_values)
+        *singular_values = singularValues.head(pcarank);
+
     if (orthogonalize)
         orthogonalize_matrix(pcamatrix, 0);
 
     return true;
 }
-
-
-bool write_matrix(const Matrix & matrix, const char * filename) {
-    const double * data = matrix.data();
-    FILE *file = fopen(filename, "wb");
-    if (!file) {
-        return false;
+void comparePCA(const Matrix & exact, const Vector & exact_singular,
+    const Matrix & approx, const Vector & approx_singular,
+    double & singular_error, double & subspace_error) {
+    const int common = std::min(exact_singular.size(), approx_singular.size());
+    singular_error = 0;
+    for (int i = 0; i < common; ++i) {
+        const double reference = std::max(exact_singular(i), 1e-12);
+        singular_error = std::max(singular_error, 
+            std::abs(exact_singular(i) - approx_singular(i)) / reference);
     }
-    const int rows = matrix.rows();
-    const int cols = matrix.cols();
-    fwrite((void*)&rows, sizeof(int), 1, file);
-    fwrite((void*)&cols, sizeof(int), 1, file);
-    fwrite((void*)data, sizeof(double), rows * cols, file);
-    if (ferror(file)) {
-        return false;
-    }
-    fclose(file);
-    return true;
+    const Matrix residual = approx - exact * (exact.transpose() * approx);
+    subspace_error = approx.cols() ? residual.norm() / std::sqrt(approx.cols()) : 0.0;
 }
 
-bool read_matrix(const char * filename, Matrix & matrix) {
-    FILE *file = fopen(filename, "rb");
-    if (!file) {
-        return false;
+int IncrementalPCA::truncatedRank(const Vector & singular) const {
+    const double cutoff = m_variance * m_total;
+    double keep = 0;
+    int rank = 0;
+    while (rank < singular.size() && keep < cutoff) {
+        keep += singular(rank) * singular(rank);
+        rank++;
     }
-    int rows = 0; 
-    int cols = 0;  
-    fread((void*)&rows, sizeof(int), 1, file);
-    fread((void*)&cols, sizeof(int), 1, file);
-    matrix.conservativeResize(rows, cols);
-    double * data = matrix.data();
-    fread((void*)data, sizeof(double), rows * cols, file);
-    if (ferror(file)) {
-        return false;
+    if (m_max_rank > 0)
+        rank = std::min(rank, m_max_rank);
+    return std::max(rank, 1);
+}
+
+void IncrementalPCA::seed(const Matrix & basis, const Vector & singular,
+    int samples, double energy) {
+    const int rank = std::min<int>(basis.cols(), singular.size());
+    m_basis    = basis.leftCols(rank);
+    m_singular = singular.head(rank);
+    m_samples  = samples;
+    // Truncated energy isn't in the basis anymore, but still counts
+    // towards variance of everything seen.
+    m_total    = std::max(energy, m_singular.squaredNorm());
+}
+
+void IncrementalPCA::update(const Eigen::Ref<const Matrix> & chunk) {
+    if (chunk.cols() == 0)
+        return;
+    m_total   += chunk.squaredNorm();
+    m_samples += chunk.cols();
+    if (m_basis.size() == 0) {
+        Eigen::JacobiSVD<Matrix> svd(chunk, Eigen::ComputeThinU);
+        const int rank = std::min<int>(truncatedRank(svd.singularValues()), chunk.cols());
+        m_basis    = svd.matrixU().leftCols(rank);
+        m_singular = svd.singularValues().head(rank);
+        return;
     }
-    fclose(file);
-    return true;
+    const int k = m_basis.cols();
+    const int c = chunk.cols();
+    // Split chunk into part inside current subspace and orthogonal residual.
+    const Matrix inside   = m_basis.transpose() * chunk;
+    Matrix       residual = chunk - m_basis * inside;
+    const Eigen::HouseholderQR<Matrix> qr(residual);
+    residual = qr.householderQ() * Matrix::Identity(chunk.rows(), c);
+    const Matrix r = qr.matrixQR().topRows(c).triangularView<Eigen::Upper>();
+
+    // Small (k + c) square core whose SVD rotates [basis, residual].
+    Matrix core = Matrix::Zero(k + c, k + c);
+    core.topLeftCorner(k, k) = m_singular.asDiagonal();
+    core.topRightCorner(k, c) = inside;
+    core.bottomRightCorner(c, c) = r;
+    Eigen::JacobiSVD<Matrix> svd(core, Eigen::ComputeThinU);
+    const int rank = std::min<int>(truncatedRank(svd.singularValues()), k + c);
+
+    Matrix rotated = m_basis * svd.matrixU().topLeftCorner(k, rank);
+    rotated.noalias() += residual * svd.matrixU().bottomLeftCorner(c, rank);
+    m_basis.swap(rotated);
+    m_singular = svd.singularValues().head(rank);
+}
+
+void IncrementalPCA::finalize(Matrix & pcamatrix, Vector & singular_values) const {
+    const int rank = std::min<int>(truncatedRank(m_singular), m_basis.cols());
+    pcamatrix       = m_basis.leftCols(rank);
+    singular_values = m_singular.head(rank);
 }
 } // end of subdeform namespace
\ No newline at end of file
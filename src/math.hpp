@@ -8,14 +8,59 @@ using StringVec = std::vector<std::string>;
 using Matrix    = Eigen::MatrixXd;
 using Vector    = Eigen::VectorXd;
 
+// SVD backend used by computePCA.
+enum class PCASolver {
+    Jacobi,     // exact, slowest
+    Gram,       // eigen decomposition of S x S Gram matrix (S << 3N)
+    Randomized, // randomized range finder, grows rank until variance is captured
+};
+
 // Should we just use EIGEN::QRMatrix?
 void orthogonalize_matrix(Matrix & matrix, int c=0);
 // Reduced deformation space cutting out columns with eigenvalues bellow variance.
+// Optionally returns singular values of kept columns (in variance order).
 bool computePCA(Matrix & matrix, Matrix & pcamatrix, 
-    double variance, bool shift=false, bool orthogonalize=false);
-// Saves matrix to a dummy binary format. 
-bool write_matrix(const Matrix & matrix, const char * filename);
-// Reads matrix from binary format.
-bool read_matrix(const char * filename, Matrix & matrix);
+    double variance, bool shift=false, bool orthogonalize=false,
+    Vector * singular_values=nullptr, PCASolver solver=PCASolver::Jacobi);
+// Compares approximate PCA against exact one: max relative error of singular
+// values and RMS distance of approx columns from the exact subspace.
+void comparePCA(const Matrix & exact, const Vector & exact_singular,
+    const Matrix & approx, const Vector & approx_singular,
+    double & singular_error, double & subspace_error);
+
+
+// Blocked incremental SVD (Brand) of a shape matrix fed in column chunks.
+// Only the current basis (3N x k) and one chunk are kept in memory; after
+// each update basis is truncated to rank capturing 'variance' of all data
+// seen so far (and to max_rank if given).
+class IncrementalPCA
+{
+public:
+    IncrementalPCA(double variance, int max_rank=0)
+        : m_variance(variance), m_max_rank(max_rank) {}
+    // Starts from a basis computed earlier (orthonormal columns in variance
+    // order) of 'samples' columns with squared norm 'energy', so new chunks
+    // are appended to it. Unknown energy (0) is taken as sum of singular^2.
+    void seed(const Matrix & basis, const Vector & singular, int samples, double energy=0);
+    void update(const Eigen::Ref<const Matrix> & chunk);
+    // Columns seen so far.
+    int  samples() const { return m_samples; }
+    // Rows of the data (0 before first update or seed).
+    int  rows() const { return m_basis.rows(); }
+    // Squared Frobenius norm of all data seen.
+    double energy() const { return m_total; }
+    // Left singular vectors and singular values truncated at variance.
+    void finalize(Matrix & pcamatrix, Vector & singular_values) const;
+
+private:
+    int truncatedRank(const Vector & singular) const;
+
+    Matrix m_basis;
+    Vector m_singular;
+    double m_variance;
+    int    m_max_rank;
+    int    m_samples = 0;
+    double m_total   = 0; // squared Frobenius norm of all data seen
+};
 
 } // end of subdeform namespace
\ No newline at end of file
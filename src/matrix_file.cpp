@@ -0,0 +1,338 @@
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <vector>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "matrix_file.hpp"
+
+namespace subdeform {
+
+uint64_t checksum64(const void * data, size_t size) {
+    constexpr uint64_t prime = 0x9E3779B97F4A7C15ULL;
+    uint64_t lanes[4] = {prime, prime ^ 1, prime ^ 2, prime ^ 3};
+    const unsigned char * bytes = static_cast<const unsigned char*>(data);
+    const size_t words = size / 8;
+    size_t i = 0;
+    for (; i + 4 <= words; i += 4) {
+        for (int l = 0; l < 4; ++l) {
+            uint64_t w;
+            memcpy(&w, bytes + 8*(i+l), 8);
+            lanes[l] = (lanes[l] ^ w) * prime;
+            lanes[l] ^= lanes[l] >> 29;
+        }
+    }
+    uint64_t hash = size;
+    for (int l = 0; l < 4; ++l)
+        hash = (hash ^ lanes[l]) * prime;
+    for (size_t b = 8*i; b < size; ++b)
+        hash = (hash ^ bytes[b]) * prime;
+    return hash ^ (hash >> 32);
+}
+
+bool MappedFile::open(const char * filename, std::string & error) {
+    close();
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        error = "Can't open file.";
+        return false;
+    }
+    LARGE_INTEGER size;
+    GetFileSizeEx(file, &size);
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (!mapping) {
+        error = "Can't map file.";
+        return false;
+    }
+    m_base = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+    CloseHandle(mapping);
+    m_size = size.QuadPart;
+#else
+    const int fd = ::open(filename, O_RDONLY);
+    if (fd < 0) {
+        error = "Can't open file.";
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        ::close(fd);
+        error = "Can't stat file.";
+        return false;
+    }
+    void * base = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (base == MAP_FAILED) {
+        error = "Can't map file.";
+        return false;
+    }
+    m_base = static_cast<const char*>(base);
+    m_size = st.st_size;
+#endif
+    if (!m_base) {
+        error = "Can't map file.";
+        m_size = 0;
+        return false;
+    }
+    return true;
+}
+
+void MappedFile::close() {
+    if (m_base) {
+#ifdef _WIN32
+        UnmapViewOfFile(m_base);
+#else
+        munmap(const_cast<char*>(m_base), m_size);
+#endif
+    }
+    m_base = nullptr;
+    m_size = 0;
+}
+
+bool MappedMatrix::open(const char * filename, bool verify) {
+    close();
+    m_error.clear();
+    if (!m_file.open(filename, m_error))
+        return fail(m_error);
+    m_base = m_file.data();
+    m_size = m_file.size();
+    return parse(verify);
+}
+
+bool MappedMatrix::view(const char * base, size_t size, bool verify) {
+    close();
+    m_error.clear();
+    if (!base || size == 0)
+        return fail("Empty matrix view.");
+    m_base = base;
+    m_size = size;
+    return parse(verify);
+}
+
+namespace {
+/// rows * cols elements of 'size' bytes fit into 'limit' bytes (no overflow).
+bool fits(uint64_t rows, uint64_t cols, uint64_t size, uint64_t limit) {
+    return rows > 0 && cols > 0 && rows <= limit / size / cols;
+}
+} // end of anonymous namespace
+
+bool MappedMatrix::parse(bool verify) {
+    if (m_size >= sizeof(MatrixHeader) && memcmp(m_base, MATRIX_MAGIC, 8) == 0) {
+        MatrixHeader header;
+        memcpy(&header, m_base, sizeof(MatrixHeader));
+        if (header.version > MATRIX_VERSION)
+            return fail("Unsupported matrix version.");
+        if (header.layout != static_cast<uint32_t>(Layout::ColMajor))
+            return fail("Unsupported matrix layout.");
+        if (header.dtype > static_cast<uint32_t>(DataType::Int8))
+            return fail("Unsupported matrix data type.");
+        m_dtype   = static_cast<DataType>(header.dtype);
+        // Sizes are checked before any product of them, a corrupt header
+        // must not wrap around into a small one.
+        if (!fits(header.rows, header.cols, dtype_size(m_dtype), m_size) ||
+            header.payload_offset > m_size || header.payload_size > m_size - header.payload_offset ||
+            header.payload_size != header.rows * header.cols * dtype_size(m_dtype))
+            return fail("Truncated or corrupted matrix file.");
+        // Singular values (and scales) sit between header and payload.
+        if (header.payload_offset < sizeof(MatrixHeader) ||
+            header.cols > (header.payload_offset - sizeof(MatrixHeader)) / sizeof(double))
+            return fail("Truncated or corrupted matrix file.");
+        m_version = header.version;
+        m_rows    = header.rows;
+        m_cols    = header.cols;
+        m_energy  = header.energy;
+        m_samples = header.samples;
+        m_payload = m_base + header.payload_offset;
+        if (header.flags & HAS_SINGULAR_VALUES) {
+            m_singular.resize(m_cols);
+            memcpy(m_singular.data(), m_base + sizeof(MatrixHeader), m_cols * sizeof(double));
+        } else {
+            m_singular.resize(0);
+        }
+        uint64_t checksum = 0;
+        if (is_quantized(m_dtype)) {
+            const size_t offset = sizeof(MatrixHeader) + m_cols * sizeof(double);
+            if (!(header.flags & HAS_BLOCK_SCALES) || header.scale_rows == 0)
+                return fail("Quantized matrix without scales.");
+            m_scale_rows = header.scale_rows;
+            const size_t bytes = m_cols * scale_blocks(m_rows, m_scale_rows) * sizeof(float);
+            if (offset + bytes > header.payload_offset)
+                return fail("Truncated or corrupted matrix file.");
+            m_scales = reinterpret_cast<const float*>(m_base + offset);
+            if (verify)
+                checksum = checksum64(m_scales, bytes);
+        }
+        if (verify && (checksum ^ checksum64(m_payload, header.payload_size)) != header.checksum)
+            return fail("Matrix checksum mismatch.");
+    } else {
+        // Legacy: int rows, int cols, double data[]
+        int dims[2] = {0, 0};
+        if (m_size < sizeof(dims))
+            return fail("Truncated matrix file.");
+        memcpy(dims, m_base, sizeof(dims));
+        m_rows    = dims[0];
+        m_cols    = dims[1];
+        m_dtype   = DataType::Float64;
+        m_version = 0;
+        m_legacy  = true;
+        m_singular.resize(0);
+        if (m_rows <= 0 || m_cols <= 0 ||
+            !fits(m_rows, m_cols, sizeof(double), m_size - sizeof(dims)))
+            return fail("Truncated or corrupted matrix file.");
+        m_payload = m_base + sizeof(dims);
+    }
+    return true;
+}
+
+void MappedMatrix::close() {
+    m_file.close();
+    m_base    = nullptr;
+    m_payload = nullptr;
+    m_size    = 0;
+    m_rows    = 0;
+    m_cols    = 0;
+    m_legacy  = false;
+    m_scales  = nullptr;
+    m_scale_rows = 0;
+    m_energy  = 0;
+    m_samples = 0;
+}
+
+namespace {
+template<typename T>
+void write_payload(const Matrix & matrix, FILE * file, uint64_t & checksum) {
+    using Storage = Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>;
+    const Storage converted = matrix.cast<T>();
+    checksum = checksum64(converted.data(), converted.size() * sizeof(T));
+    fwrite(converted.data(), sizeof(T), converted.size(), file);
+}
+
+/// Symmetric quantization of every (column, row block) against its max |value|.
+template<typename Q>
+void quantize(const Matrix & matrix, int64_t scale_rows,
+    Eigen::Matrix<Q, Eigen::Dynamic, Eigen::Dynamic> & quantized, std::vector<float> & scales) {
+    constexpr double qmax = std::numeric_limits<Q>::max();
+    const int64_t blocks = scale_blocks(matrix.rows(), scale_rows);
+    quantized.resize(matrix.rows(), matrix.cols());
+    scales.resize(matrix.cols() * blocks);
+    for (int64_t c = 0; c < matrix.cols(); ++c) {
+        for (int64_t b = 0; b < blocks; ++b) {
+            const int64_t first = b * scale_rows;
+            const int64_t count = std::min(scale_rows, matrix.rows() - first);
+            const auto values   = matrix.col(c).segment(first, count);
+            const double amax   = values.cwiseAbs().maxCoeff();
+            const float scale   = amax > 0 ? float(amax / qmax) : 1.0f;
+            scales[c*blocks + b] = scale;
+            // Round against the float scale readers multiply with.
+            const double inv = 1.0 / double(scale);
+            for (int64_t r = 0; r < count; ++r) {
+                const double q = std::round(values[r] * inv);
+                quantized(first + r, c) = Q(std::max(-qmax, std::min(qmax, q)));
+            }
+        }
+    }
+}
+
+template<typename Q>
+void write_quantized(const Matrix & matrix, int64_t scale_rows, FILE * file,
+    uint64_t scales_offset, uint64_t & checksum) {
+    Eigen::Matrix<Q, Eigen::Dynamic, Eigen::Dynamic> quantized;
+    std::vector<float> scales;
+    quantize(matrix, scale_rows, quantized, scales);
+    checksum = checksum64(scales.data(), scales.size() * sizeof(float))
+        ^ checksum64(quantized.data(), quantized.size() * sizeof(Q));
+    fwrite(quantized.data(), sizeof(Q), quantized.size(), file);
+    fseek(file, scales_offset, SEEK_SET);
+    fwrite(scales.data(), sizeof(float), scales.size(), file);
+}
+} // end of anonymous namespace
+
+bool write_matrix(const Matrix & matrix, const char * filename,
+    const Vector * singular_values, DataType dtype, double energy, int64_t samples) {
+    FILE *file = fopen(filename, "wb");
+    if (!file) {
+        return false;
+    }
+    const bool written = write_matrix(matrix, file, singular_values, dtype, energy, samples);
+    const bool failed  = fclose(file) != 0;
+    return written && !failed;
+}
+
+bool write_matrix(const Matrix & matrix, FILE * file,
+    const Vector * singular_values, DataType dtype, double energy, int64_t samples) {
+    const long base = ftell(file);
+    if (base < 0)
+        return false;
+    const bool quantized  = is_quantized(dtype);
+    const uint64_t svsize = matrix.cols() * sizeof(double);
+    const uint64_t scsize = quantized
+        ? matrix.cols() * scale_blocks(matrix.rows(), MATRIX_SCALE_ROWS) * sizeof(float) : 0;
+    MatrixHeader header;
+    memset(&header, 0, sizeof(MatrixHeader));
+    memcpy(header.magic, MATRIX_MAGIC, 8);
+    // Only quantized files need version 2 readers.
+    header.version  = quantized ? MATRIX_VERSION : 1;
+    header.dtype    = static_cast<uint32_t>(dtype);
+    header.layout   = static_cast<uint32_t>(Layout::ColMajor);
+    header.rows     = matrix.rows();
+    header.cols     = matrix.cols();
+    header.payload_offset = (sizeof(MatrixHeader) + svsize + scsize + MATRIX_PAGE_SIZE - 1)
+        / MATRIX_PAGE_SIZE * MATRIX_PAGE_SIZE;
+    header.payload_size   = matrix.size() * dtype_size(dtype);
+    header.energy   = energy;
+    header.samples  = samples;
+    if (quantized) {
+        header.flags     |= HAS_BLOCK_SCALES;
+        header.scale_rows = MATRIX_SCALE_ROWS;
+    }
+
+    Vector singular = Vector::Zero(matrix.cols());
+    if (singular_values && singular_values->size() >= matrix.cols()) {
+        singular = singular_values->head(matrix.cols());
+        header.flags |= HAS_SINGULAR_VALUES;
+    }
+
+    // Header (and scales) are rewritten once payload checksum is known.
+    fwrite(&header, sizeof(MatrixHeader), 1, file);
+    fwrite(singular.data(), sizeof(double), singular.size(), file);
+    const std::vector<char> padding(header.payload_offset - sizeof(MatrixHeader) - svsize, 0);
+    fwrite(padding.data(), 1, padding.size(), file);
+    const uint64_t scales_offset = base + sizeof(MatrixHeader) + svsize;
+    switch (dtype) {
+        case DataType::Float64:
+            header.checksum = checksum64(matrix.data(), header.payload_size);
+            fwrite(matrix.data(), sizeof(double), matrix.size(), file);
+            break;
+        case DataType::Float32: write_payload<float>(matrix, file, header.checksum); break;
+        case DataType::Float16: write_payload<Eigen::half>(matrix, file, header.checksum); break;
+        case DataType::Int16:
+            write_quantized<int16_t>(matrix, MATRIX_SCALE_ROWS, file, scales_offset, header.checksum);
+            break;
+        case DataType::Int8:
+            write_quantized<int8_t>(matrix, MATRIX_SCALE_ROWS, file, scales_offset, header.checksum);
+            break;
+    }
+    fseek(file, base, SEEK_SET);
+    fwrite(&header, sizeof(MatrixHeader), 1, file);
+    fseek(file, 0, SEEK_END);
+    return ferror(file) == 0;
+}
+
+bool read_matrix(const char * filename, Matrix & matrix) {
+    MappedMatrix mapped;
+    if (!mapped.open(filename)) {
+        return false;
+    }
+    mapped.copyTo(matrix);
+    return true;
+}
+} // end of subdeform namespace
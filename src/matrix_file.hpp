@@ -0,0 +1,224 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include "math.hpp"
+
+namespace subdeform {
+
+/// On disk layout of a subspace matrix (version 1):
+///
+///   [MatrixHeader][singular values: cols * double][padding][payload]
+///
+/// Payload starts at a page aligned offset so it can be mapped and wrapped
+/// with Eigen::Map without copying. Old files (int rows, int cols, double[])
+/// are still recognized and mapped the same way.
+///
+/// Version 2 adds quantized payloads (Int16, Int8): value = q * scale, one
+/// float scale per column and block of 'scale_rows' rows, stored column by
+/// column right after singular values:
+///
+///   [MatrixHeader][singular values][scales: cols * blocks * float][padding][payload]
+///
+/// Float files are still written as version 1. PCA bases also record the
+/// energy and sample count of the shapes they were computed from (in
+/// formerly reserved, zeroed header fields), so shapes can later be appended
+/// to the basis without the original ones (subdeform --append).
+constexpr char     MATRIX_MAGIC[8]     = {'S','U','B','D','M','T','X','\0'};
+constexpr uint32_t MATRIX_VERSION      = 2;
+constexpr uint64_t MATRIX_PAGE_SIZE    = 4096;
+/// Rows sharing one scale in quantized files (a GA page of points).
+constexpr uint64_t MATRIX_SCALE_ROWS   = 3072;
+
+enum class DataType : uint32_t {
+    Float64 = 0,
+    Float32 = 1,
+    Float16 = 2,
+    Int16   = 3,
+    Int8    = 4,
+};
+
+enum class Layout : uint32_t {
+    ColMajor = 0,
+};
+
+enum MatrixFlags : uint32_t {
+    HAS_SINGULAR_VALUES = 1 << 0,
+    HAS_BLOCK_SCALES    = 1 << 1,
+};
+
+struct MatrixHeader {
+    char     magic[8];
+    uint32_t version;
+    uint32_t dtype;
+    uint32_t layout;
+    uint32_t flags;
+    uint64_t rows;
+    uint64_t cols;
+    uint64_t payload_offset;
+    uint64_t payload_size;
+    uint64_t checksum;
+    uint64_t scale_rows;    // rows per scale block (quantized dtypes only)
+    double   energy;        // squared norm of the data a PCA basis came from (0 if unknown)
+    uint64_t samples;       // columns of that data (0 if unknown)
+    uint64_t reserved[5];
+};
+static_assert(sizeof(MatrixHeader) == 128, "MatrixHeader must stay 128 bytes.");
+
+using MatrixMap = Eigen::Map<const Matrix>;
+
+inline size_t dtype_size(DataType dtype) {
+    switch (dtype) {
+        case DataType::Float64: return sizeof(double);
+        case DataType::Float32: return sizeof(float);
+        case DataType::Float16: return sizeof(Eigen::half);
+        case DataType::Int16:   return sizeof(int16_t);
+        case DataType::Int8:    return sizeof(int8_t);
+    }
+    return 0;
+}
+
+inline bool is_quantized(DataType dtype) {
+    return dtype == DataType::Int16 || dtype == DataType::Int8;
+}
+
+/// Number of scale blocks per column of a quantized matrix.
+inline int64_t scale_blocks(int64_t rows, int64_t scale_rows) {
+    return (rows + scale_rows - 1) / scale_rows;
+}
+
+/// 64 bit checksum of a memory block (4 lanes of multiplicative hashing).
+uint64_t checksum64(const void * data, size_t size);
+
+/// Read only mapping of a whole file.
+class MappedFile
+{
+public:
+    MappedFile() = default;
+    ~MappedFile() { close(); }
+    MappedFile(const MappedFile &) = delete;
+    MappedFile & operator=(const MappedFile &) = delete;
+
+    bool open(const char * filename, std::string & error);
+    void close();
+
+    bool         isOpen() const { return m_base != nullptr; }
+    const char * data()   const { return m_base; }
+    size_t       size()   const { return m_size; }
+
+private:
+    const char * m_base = nullptr;
+    size_t       m_size = 0;
+};
+
+/// Read only, memory mapped subspace matrix. Payload is shared with
+/// the page cache, so (re)loading costs page faults instead of a copy.
+class MappedMatrix
+{
+public:
+    MappedMatrix() = default;
+    ~MappedMatrix() { close(); }
+    MappedMatrix(const MappedMatrix &) = delete;
+    MappedMatrix & operator=(const MappedMatrix &) = delete;
+
+    /// Maps the file. With verify it also walks the payload to check its checksum.
+    bool open(const char * filename, bool verify=false);
+    /// Reads a matrix embedded in memory mapped elsewhere (e.g. a region of
+    /// a RegionBasis file), which has to outlive this object.
+    bool view(const char * base, size_t size, bool verify=false);
+    void close();
+
+    bool        isOpen()   const { return m_base != nullptr; }
+    bool        isLegacy() const { return m_legacy; }
+    int64_t     rows()     const { return m_rows; }
+    int64_t     cols()     const { return m_cols; }
+    DataType    dtype()    const { return m_dtype; }
+    uint32_t    version()  const { return m_version; }
+    const void *payload()  const { return m_payload; }
+    /// Singular values stored along the matrix (empty if file has none).
+    const Vector & singularValues() const { return m_singular; }
+    /// Squared norm and column count of the data the basis was computed
+    /// from (0 if not recorded).
+    double      energy()      const { return m_energy; }
+    int64_t     samples()     const { return m_samples; }
+    /// Block scales of quantized payload (cols * scale_blocks() floats).
+    const float * scales()    const { return m_scales; }
+    int64_t     scaleRows()   const { return m_scale_rows; }
+    const std::string & error() const { return m_error; }
+
+    /// Zero copy view of Float64 payload.
+    MatrixMap matrix() const {
+        return MatrixMap(static_cast<const double*>(m_payload), m_rows, m_cols);
+    }
+    /// Zero copy view of payload as T (caller checks dtype()).
+    template<typename T>
+    Eigen::Map<const Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> > mapAs() const {
+        return Eigen::Map<const Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> >(
+            static_cast<const T*>(m_payload), m_rows, m_cols);
+    }
+    /// Copies payload into a dense matrix of T converting from any dtype
+    /// (quantized ones are dequantized).
+    template<typename T>
+    void copyTo(Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> & out) const {
+        switch (m_dtype) {
+            case DataType::Float64: out = mapAs<double>().template cast<T>(); break;
+            case DataType::Float32: out = mapAs<float>().template cast<T>(); break;
+            case DataType::Float16: out = mapAs<Eigen::half>().template cast<T>(); break;
+            case DataType::Int16:   dequantize<int16_t>(out); break;
+            case DataType::Int8:    dequantize<int8_t>(out); break;
+        }
+    }
+
+private:
+    template<typename Q, typename T>
+    void dequantize(Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> & out) const {
+        const int64_t blocks = scale_blocks(m_rows, m_scale_rows);
+        out = mapAs<Q>().template cast<T>();
+        for (int64_t c = 0; c < m_cols; ++c) {
+            for (int64_t b = 0; b < blocks; ++b) {
+                const int64_t first = b * m_scale_rows;
+                out.col(c).segment(first, std::min(m_scale_rows, m_rows - first))
+                    *= T(m_scales[c*blocks + b]);
+            }
+        }
+    }
+
+    bool parse(bool verify);
+    bool fail(const std::string & message) { m_error = message; close(); return false; }
+
+    MappedFile   m_file;
+    const char * m_base    = nullptr;
+    size_t       m_size    = 0;
+    const void * m_payload = nullptr;
+    int64_t      m_rows    = 0;
+    int64_t      m_cols    = 0;
+    DataType     m_dtype   = DataType::Float64;
+    uint32_t     m_version = 0;
+    bool         m_legacy  = false;
+    const float *m_scales  = nullptr;
+    int64_t      m_scale_rows = 0;
+    double       m_energy  = 0;
+    int64_t      m_samples = 0;
+    Vector       m_singular;
+    std::string  m_error;
+};
+
+/// Saves matrix (and optionally its singular values) in versioned format.
+/// Payload is converted to dtype on write (Float16 halves disk and page cache use
+/// of Float32 at the cost of ~3 significant digits). Int16/Int8 quantize each
+/// block of MATRIX_SCALE_ROWS rows of a column against its own max |value|,
+/// so a local deformation doesn't cost precision everywhere else.
+/// energy and samples describe the data a PCA basis came from (see MatrixHeader).
+bool write_matrix(const Matrix & matrix, const char * filename,
+    const Vector * singular_values=nullptr, DataType dtype=DataType::Float64,
+    double energy=0, int64_t samples=0);
+/// Same, written at file's current position (header offsets are relative
+/// to it, so the position should be page aligned). File is left at its end.
+bool write_matrix(const Matrix & matrix, FILE * file,
+    const Vector * singular_values=nullptr, DataType dtype=DataType::Float64,
+    double energy=0, int64_t samples=0);
+/// Reads matrix from any supported format into memory (copy, converted to double).
+bool read_matrix(const char * filename, Matrix & matrix);
+
+} // end of subdeform namespace
@@ -0,0 +1,209 @@
+#pragma once
+#include <GU/GU_Detail.h>
+#include <GA/GA_Handle.h>
+#include <GA/GA_PageHandle.h>
+#include <UT/UT_Array.h>
+#include <UT/UT_ParallelUtil.h>
+
+namespace subdeform {
+
+/// Point offsets in row order: all points of a detail by point number, or
+/// an explicit list (group members). Rows are what bases, deltas and
+/// displacements are indexed by; offsets are where attributes live.
+///
+/// A trivial map (offset == number, no holes) stores nothing. Otherwise
+/// offsets are cached and update() only rebuilds them when the detail's
+/// point layout changed.
+class PointMap
+{
+public:
+    PointMap() = default;
+    explicit PointMap(const GU_Detail & gdp) { update(gdp); }
+
+    /// All points of gdp by point number. Returns false (map kept) if
+    /// gdp's point layout is the one of the last call.
+    bool update(const GU_Detail & gdp) {
+        const exint detail = gdp.getUniqueId();
+        const exint meta   = gdp.getMetaCacheCount();
+        if (detail == m_detail && meta == m_meta && m_size == gdp.getNumPoints()
+            && m_capacity == gdp.getNumPointOffsets())
+            return false;
+        m_detail   = detail;
+        m_meta     = meta;
+        m_size     = gdp.getNumPoints();
+        m_capacity = gdp.getNumPointOffsets();
+        m_trivial  = gdp.getPointMap().isTrivialMap();
+        m_offsets.clear();
+        if (!m_trivial) {
+            m_offsets.setSizeNoInit(m_size);
+            for (GA_Index index = 0; index < m_size; ++index)
+                m_offsets(index) = gdp.pointOffset(index);
+        }
+        return true;
+    }
+    /// Explicit offsets, rows follow their order.
+    void assign(const UT_Array<GA_Offset> & offsets) {
+        m_offsets  = offsets;
+        m_size     = offsets.size();
+        m_trivial  = false;
+        m_detail   = -1;
+    }
+    void clear() { m_offsets.clear(); m_size = 0; m_trivial = true; m_detail = -1; }
+
+    GA_Size   size()    const { return m_size; }
+    bool      trivial() const { return m_trivial; }
+    GA_Offset offset(GA_Index row) const { return m_trivial ? GA_Offset(row) : m_offsets(row); }
+
+private:
+    UT_Array<GA_Offset> m_offsets; // empty if trivial
+    GA_Size m_size     = 0;
+    bool    m_trivial  = true;
+    // Layout of the detail update() built the map from.
+    exint   m_detail   = -1;
+    exint   m_meta     = -1;
+    GA_Size m_capacity = 0;
+};
+
+/// Page sized chunks of 'count' rows. Chunks of a trivial map are pages.
+inline exint point_chunks(GA_Size count) {
+    return (count + GA_PAGE_SIZE - 1) / GA_PAGE_SIZE;
+}
+
+/// Calls op(chunk, first, last) for every chunk of rows [0, count) on
+/// Houdini's task scheduler.
+template<typename Op>
+inline void parallel_point_chunks(GA_Size count, const Op & op) {
+    UTparallelFor(UT_BlockedRange<exint>(0, point_chunks(count)),
+        [&](const UT_BlockedRange<exint> & range) {
+        for (exint chunk = range.begin(); chunk != range.end(); ++chunk) {
+            const GA_Index first = chunk*GA_PAGE_SIZE;
+            op(chunk, first, GA_Index(SYSmin(GA_Size(first + GA_PAGE_SIZE), count)));
+        }
+    });
+}
+
+namespace detail {
+/// Splits rows [first, last) into runs of consecutive offsets within one
+/// page and calls run(row - first, start, end) for each, so page handles
+/// are set once per run instead of per point.
+template<typename Run>
+inline void for_each_run(const PointMap & points, GA_Index first, GA_Index last,
+    const Run & run) {
+    for (GA_Index row = first; row < last; ) {
+        const GA_Offset start = points.offset(row);
+        GA_Index end = SYSmin(last, GA_Index(row + GA_PAGE_SIZE - GAgetPageOff(start)));
+        if (!points.trivial()) {
+            GA_Index next = row + 1;
+            while (next < end && points.offset(next) == start + (next - row))
+                ++next;
+            end = next;
+        }
+        run(row - first, start, start + (end - row));
+        row = end;
+    }
+}
+} // end of detail namespace
+
+/// out = attrib of rows [first, last), xyz per row.
+template<typename T>
+inline void read_points(const GA_Attribute * attrib, const PointMap & points,
+    GA_Index first, GA_Index last, T * out) {
+    GA_ROPageHandleV3 ph(attrib);
+    detail::for_each_run(points, first, last, [&](GA_Index row, GA_Offset start, GA_Offset end) {
+        ph.setPage(start);
+        T * d = out + 3*row;
+        for (GA_Offset ptoff = start; ptoff < end; ++ptoff, d += 3) {
+            const UT_Vector3 value = ph.get(ptoff);
+            d[0] = value.x(); d[1] = value.y(); d[2] = value.z();
+        }
+    });
+}
+
+/// out = a - b of rows [first, last), both attributes of one detail.
+template<typename T>
+inline void read_point_deltas(const GA_Attribute * a, const GA_Attribute * b,
+    const PointMap & points, GA_Index first, GA_Index last, T * out) {
+    GA_ROPageHandleV3 a_ph(a);
+    GA_ROPageHandleV3 b_ph(b);
+    detail::for_each_run(points, first, last, [&](GA_Index row, GA_Offset start, GA_Offset end) {
+        a_ph.setPage(start);
+        b_ph.setPage(start);
+        T * d = out + 3*row;
+        for (GA_Offset ptoff = start; ptoff < end; ++ptoff, d += 3) {
+            const UT_Vector3 delta = a_ph.get(ptoff) - b_ph.get(ptoff);
+            d[0] = delta.x(); d[1] = delta.y(); d[2] = delta.z();
+        }
+    });
+}
+
+/// out -= attrib of rows [first, last), for deltas between two details.
+template<typename T>
+inline void subtract_points(const GA_Attribute * attrib, const PointMap & points,
+    GA_Index first, GA_Index last, T * out) {
+    GA_ROPageHandleV3 ph(attrib);
+    detail::for_each_run(points, first, last, [&](GA_Index row, GA_Offset start, GA_Offset end) {
+        ph.setPage(start);
+        T * d = out + 3*row;
+        for (GA_Offset ptoff = start; ptoff < end; ++ptoff, d += 3) {
+            const UT_Vector3 value = ph.get(ptoff);
+            d[0] -= value.x(); d[1] -= value.y(); d[2] -= value.z();
+        }
+    });
+}
+
+/// attrib = in of rows [first, last).
+///
+/// Writes of a non-trivial map go point by point: its chunks share pages,
+/// and a page handle of an attribute not stored as fp32 buffers the whole
+/// page and writes it back, clobbering what other chunks wrote meanwhile.
+/// Chunks of a trivial map are whole pages of their own.
+template<typename T>
+inline void write_points(GA_Attribute * attrib, const PointMap & points,
+    GA_Index first, GA_Index last, const T * in) {
+    if (!points.trivial()) {
+        GA_RWHandleV3 handle(attrib);
+        for (GA_Index row = first; row < last; ++row, in += 3)
+            handle.set(points.offset(row), UT_Vector3(in[0], in[1], in[2]));
+        return;
+    }
+    GA_RWPageHandleV3 ph(attrib);
+    detail::for_each_run(points, first, last, [&](GA_Index row, GA_Offset start, GA_Offset end) {
+        ph.setPage(start);
+        const T * d = in + 3*row;
+        for (GA_Offset ptoff = start; ptoff < end; ++ptoff, d += 3)
+            ph.set(ptoff, UT_Vector3(d[0], d[1], d[2]));
+    });
+}
+
+/// attrib += scale * in of rows [first, last). in is rounded to float
+/// before scaling, so float and double inputs of equal value match.
+/// Non-trivial maps write point by point, see write_points().
+template<typename T>
+inline void add_points(GA_Attribute * attrib, const PointMap & points,
+    GA_Index first, GA_Index last, const T * in, const float scale) {
+    if (!points.trivial()) {
+        GA_RWHandleV3 handle(attrib);
+        for (GA_Index row = first; row < last; ++row, in += 3) {
+            const GA_Offset ptoff = points.offset(row);
+            handle.set(ptoff, handle.get(ptoff) + UT_Vector3(in[0], in[1], in[2]) * scale);
+        }
+        return;
+    }
+    GA_RWPageHandleV3 ph(attrib);
+    detail::for_each_run(points, first, last, [&](GA_Index row, GA_Offset start, GA_Offset end) {
+        ph.setPage(start);
+        const T * d = in + 3*row;
+        for (GA_Offset ptoff = start; ptoff < end; ++ptoff, d += 3)
+            ph.set(ptoff, ph.get(ptoff) + UT_Vector3(d[0], d[1], d[2]) * scale);
+    });
+}
+
+/// Chunks of a non-trivial map share pages, so pages a parallel write
+/// touches are hardened upfront instead of by whichever chunk comes first
+/// (per point writes then only touch their own values).
+inline void prepare_point_writes(GA_Attribute * attrib, const PointMap & points) {
+    if (!points.trivial())
+        attrib->hardenAllPages();
+}
+
+} // end of subdeform namespace
@@ -0,0 +1,80 @@
+#include <algorithm>
+#include <cstdio>
+#include "profile.hpp"
+
+namespace subdeform {
+
+const char * stage_name(const Stage stage) {
+    switch (stage) {
+        case Stage::Load:        return "load";
+        case Stage::Copy:        return "copy";
+        case Stage::Delta:       return "delta";
+        case Stage::Project:     return "project";
+        case Stage::Reconstruct: return "reconstruct";
+        case Stage::Scatter:     return "scatter";
+        case Stage::PCA:         return "pca";
+        case Stage::Write:       return "write";
+        case Stage::Count:       break;
+    }
+    return "";
+}
+
+double Profile::other() const {
+    double staged = 0;
+    for (int i = 0; i < STAGE_COUNT; ++i)
+        staged += seconds[i];
+    return std::max(0.0, wall - staged);
+}
+
+void Profile::split(const Stage a, const Stage b, const double pass_wall,
+    const double thread_a, const double thread_b) {
+    const double thread = thread_a + thread_b;
+    const double share  = thread > 0 ? thread_a / thread : 0.5;
+    add(a, pass_wall * share);
+    add(b, pass_wall * (1 - share));
+}
+
+std::string Profile::json() const {
+    std::string out = "{";
+    char buffer[128];
+    snprintf(buffer, sizeof(buffer), "\"path\": \"%s\", \"wall_ms\": %.4f", path, 1e3 * wall);
+    out += buffer;
+    for (int i = 0; i < STAGE_COUNT; ++i) {
+        snprintf(buffer, sizeof(buffer), ", \"%s_ms\": %.4f",
+            stage_name(static_cast<Stage>(i)), 1e3 * seconds[i]);
+        out += buffer;
+    }
+    snprintf(buffer, sizeof(buffer), ", \"other_ms\": %.4f, \"points\": %lld, \"components\": %lld",
+        1e3 * other(), (long long)points, (long long)components);
+    out += buffer;
+    snprintf(buffer, sizeof(buffer), ", \"basis_bytes\": %llu, \"alloc_bytes\": %llu, \"threads\": %d}",
+        (unsigned long long)basis_bytes, (unsigned long long)alloc_bytes, threads);
+    out += buffer;
+    return out;
+}
+
+std::string Profile::text() const {
+    std::string out;
+    char buffer[128];
+    snprintf(buffer, sizeof(buffer), "Last cook: %s, %.3f ms on %d threads\n",
+        path, 1e3 * wall, threads);
+    out += buffer;
+    for (int i = 0; i < STAGE_COUNT; ++i) {
+        if (seconds[i] == 0)
+            continue;
+        snprintf(buffer, sizeof(buffer), "  %-12s %10.3f ms\n",
+            stage_name(static_cast<Stage>(i)), 1e3 * seconds[i]);
+        out += buffer;
+    }
+    snprintf(buffer, sizeof(buffer), "  %-12s %10.3f ms\n", "other", 1e3 * other());
+    out += buffer;
+    snprintf(buffer, sizeof(buffer), "Points: %lld, components: %lld\n",
+        (long long)points, (long long)components);
+    out += buffer;
+    snprintf(buffer, sizeof(buffer), "Basis: %.2f MB, temporaries: %.2f MB\n",
+        basis_bytes / (1024.0*1024.0), alloc_bytes / (1024.0*1024.0));
+    out += buffer;
+    return out;
+}
+
+} // end of subdeform namespace
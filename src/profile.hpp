@@ -0,0 +1,124 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace subdeform {
+
+/// Stages of a SOP cook or a command line run timed by Profile.
+enum class Stage : int {
+    Load,        // basis, weight stream or geometry files (and sub-basis gather)
+    Copy,        // input geometry duplicated into the output
+    Delta,       // P - rest (or shape - skin) gathered
+    Project,     // U^T * delta
+    Reconstruct, // U * weights
+    Scatter,     // displacement written back to P
+    PCA,
+    Write,
+    Count
+};
+constexpr int STAGE_COUNT = static_cast<int>(Stage::Count);
+
+const char * stage_name(Stage stage);
+
+using ProfileClock = std::chrono::steady_clock;
+
+inline double seconds_since(const ProfileClock::time_point start) {
+    return std::chrono::duration<double>(ProfileClock::now() - start).count();
+}
+
+/// Wall time per stage and counters of one cook or run. Timers wrap whole
+/// stages or page sized work items (see ProjectionEngine), a few clock reads
+/// per 1024 points, so profiling is meant to stay on in production.
+struct Profile {
+    double      seconds[STAGE_COUNT] = {};
+    double      wall        = 0;  // whole cook/run, stages plus anything else
+    const char *path        = ""; // what the cook did (projected, cached, ...)
+    int64_t     points      = 0;
+    int64_t     components  = 0;
+    size_t      basis_bytes = 0;  // basis held in memory (mapped or owned)
+    size_t      alloc_bytes = 0;  // temporaries sized for this cook/run
+    int         threads     = 0;
+
+    void   reset() { *this = Profile(); }
+    void   add(const Stage stage, const double s) { seconds[static_cast<int>(stage)] += s; }
+    double stage(const Stage stage) const { return seconds[static_cast<int>(stage)]; }
+    /// Wall time not covered by any stage.
+    double other() const;
+    /// Splits wall time of a pass fusing two stages in proportion to the
+    /// thread time each of them took.
+    void   split(Stage a, Stage b, double pass_wall, double thread_a, double thread_b);
+
+    /// Single line JSON object, times in milliseconds.
+    std::string json() const;
+    /// Human readable lines (node info).
+    std::string text() const;
+};
+
+/// Adds wall time of its scope to a stage; does nothing without profile.
+class ScopedStage
+{
+public:
+    ScopedStage(Profile * profile, const Stage stage)
+        : m_profile(profile), m_stage(stage) {
+        if (m_profile)
+            m_start = ProfileClock::now();
+    }
+    ~ScopedStage() {
+        if (m_profile)
+            m_profile->add(m_stage, seconds_since(m_start));
+    }
+    ScopedStage(const ScopedStage &) = delete;
+    ScopedStage & operator=(const ScopedStage &) = delete;
+
+private:
+    Profile *               m_profile;
+    Stage                   m_stage;
+    ProfileClock::time_point m_start;
+};
+
+/// Two stages fused in one parallel pass (e.g. delta gather and U^T * delta
+/// per page). Tasks time both parts of their work items and add them once
+/// per task; on destruction the pass' wall time is split in proportion (see
+/// Profile::split()). Without profile now() doesn't read the clock.
+class FusedStages
+{
+public:
+    FusedStages(Profile * profile, const Stage first, const Stage second)
+        : m_profile(profile), m_first(first), m_second(second) {
+        if (m_profile)
+            m_start = ProfileClock::now();
+    }
+    ~FusedStages() {
+        if (m_profile) {
+            m_profile->split(m_first, m_second, seconds_since(m_start),
+                std::chrono::duration<double>(ProfileClock::duration(m_first_time.load())).count(),
+                std::chrono::duration<double>(ProfileClock::duration(m_second_time.load())).count());
+        }
+    }
+    FusedStages(const FusedStages &) = delete;
+    FusedStages & operator=(const FusedStages &) = delete;
+
+    ProfileClock::time_point now() const {
+        return m_profile ? ProfileClock::now() : ProfileClock::time_point();
+    }
+    /// Thread time a task spent in each stage.
+    void add(const ProfileClock::duration first, const ProfileClock::duration second) {
+        if (!m_profile)
+            return;
+        m_first_time  += first.count();
+        m_second_time += second.count();
+    }
+
+private:
+    Profile *                m_profile;
+    Stage                    m_first;
+    Stage                    m_second;
+    ProfileClock::time_point m_start;
+    std::atomic<ProfileClock::rep> m_first_time{0};
+    std::atomic<ProfileClock::rep> m_second_time{0};
+};
+
+} // end of subdeform namespace
@@ -0,0 +1,435 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <type_traits>
+#include "math.hpp"
+
+namespace subdeform {
+
+using MatrixF = Eigen::MatrixXf;
+using VectorF = Eigen::VectorXf;
+
+/// Rows processed per block so that a block of delta/output stays in L1/L2
+/// while all basis columns stream through it.
+constexpr int64_t PROJECTION_ROW_BLOCK = 2048;
+
+/// weights += U[rows]^T * delta, where U[rows] is a block of 'rows' rows of
+/// a column major basis with leading dimension 'ld', stored in S (double,
+/// float or Eigen::half) and computed in T. Mixed types are converted in
+/// registers, so half precision bases never get expanded in memory.
+template<typename S, typename T>
+void project(const S * basis, int64_t ld, int64_t rows, int64_t cols,
+    const T * delta, T * weights)
+{
+    using ColMap = Eigen::Map<const Eigen::Matrix<S, Eigen::Dynamic, 1> >;
+    using VecMap = Eigen::Map<const Eigen::Matrix<T, Eigen::Dynamic, 1> >;
+    if (std::is_same<S, T>::value) {
+        using MatMap = Eigen::Map<const Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>, 
+            0, Eigen::OuterStride<> >;
+        Eigen::Map<Eigen::Matrix<T, Eigen::Dynamic, 1> > w(weights, cols);
+        w.noalias() += MatMap(reinterpret_cast<const T*>(basis), rows, cols, 
+            Eigen::OuterStride<>(ld)).transpose() * VecMap(delta, rows);
+        return;
+    }
+    for (int64_t r = 0; r < rows; r += PROJECTION_ROW_BLOCK) {
+        const int64_t n = std::min(PROJECTION_ROW_BLOCK, rows - r);
+        const VecMap d(delta + r, n);
+        for (int64_t c = 0; c < cols; ++c) {
+            const ColMap u(basis + c*ld + r, n);
+            weights[c] += u.template cast<T>().dot(d);
+        }
+    }
+}
+
+/// out = U[rows] * weights (see project() for layout and storage types).
+template<typename S, typename T>
+void reconstruct(const S * basis, int64_t ld, int64_t rows, int64_t cols,
+    const T * weights, T * out)
+{
+    using ColMap = Eigen::Map<const Eigen::Matrix<S, Eigen::Dynamic, 1> >;
+    using OutMap = Eigen::Map<Eigen::Matrix<T, Eigen::Dynamic, 1> >;
+    if (std::is_same<S, T>::value) {
+        using MatMap = Eigen::Map<const Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>, 
+            0, Eigen::OuterStride<> >;
+        OutMap o(out, rows);
+        o.noalias() = MatMap(reinterpret_cast<const T*>(basis), rows, cols, 
+            Eigen::OuterStride<>(ld))
+            * Eigen::Map<const Eigen::Matrix<T, Eigen::Dynamic, 1> >(weights, cols);
+        return;
+    }
+    for (int64_t r = 0; r < rows; r += PROJECTION_ROW_BLOCK) {
+        const int64_t n = std::min(PROJECTION_ROW_BLOCK, rows - r);
+        OutMap o(out + r, n);
+        o.setZero();
+        for (int64_t c = 0; c < cols; ++c) {
+            const ColMap u(basis + c*ld + r, n);
+            o += weights[c] * u.template cast<T>();
+        }
+    }
+}
+
+/// weights += U[rows]^T * delta for 'count' deltas at once (delta is rows x
+/// count, weights cols x count, both column major). One GEMM instead of
+/// 'count' GEMVs, so the basis is streamed once per block, not per delta.
+/// Mixed types convert a row block of the basis at a time.
+template<typename S, typename T>
+void project_block(const S * basis, int64_t ld, int64_t rows, int64_t cols,
+    const T * delta, int64_t count, T * weights)
+{
+    using Block  = Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>;
+    using MatMap = Eigen::Map<const Eigen::Matrix<S, Eigen::Dynamic, Eigen::Dynamic>, 
+        0, Eigen::OuterStride<> >;
+    using DeltaMap = Eigen::Map<const Block, 0, Eigen::OuterStride<> >;
+    Eigen::Map<Block> w(weights, cols, count);
+    if (std::is_same<S, T>::value) {
+        w.noalias() += Eigen::Map<const Block, 0, Eigen::OuterStride<> >(
+            reinterpret_cast<const T*>(basis), rows, cols, Eigen::OuterStride<>(ld)).transpose()
+            * DeltaMap(delta, rows, count, Eigen::OuterStride<>(rows));
+        return;
+    }
+    Block u;
+    for (int64_t r = 0; r < rows; r += PROJECTION_ROW_BLOCK) {
+        const int64_t n = std::min(PROJECTION_ROW_BLOCK, rows - r);
+        u = MatMap(basis + r, n, cols, Eigen::OuterStride<>(ld)).template cast<T>();
+        w.noalias() += u.transpose() * DeltaMap(delta + r, n, count, Eigen::OuterStride<>(rows));
+    }
+}
+
+/// out = U[rows] * weights for 'count' weight vectors (out is rows x count,
+/// see project_block()).
+template<typename S, typename T>
+void reconstruct_block(const S * basis, int64_t ld, int64_t rows, int64_t cols,
+    const T * weights, int64_t count, T * out)
+{
+    using Block  = Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>;
+    using MatMap = Eigen::Map<const Eigen::Matrix<S, Eigen::Dynamic, Eigen::Dynamic>, 
+        0, Eigen::OuterStride<> >;
+    using OutMap = Eigen::Map<Block, 0, Eigen::OuterStride<> >;
+    const Eigen::Map<const Block> w(weights, cols, count);
+    if (std::is_same<S, T>::value) {
+        OutMap(out, rows, count, Eigen::OuterStride<>(rows)).noalias() = 
+            Eigen::Map<const Block, 0, Eigen::OuterStride<> >(reinterpret_cast<const T*>(basis), 
+                rows, cols, Eigen::OuterStride<>(ld)) * w;
+        return;
+    }
+    Block u;
+    for (int64_t r = 0; r < rows; r += PROJECTION_ROW_BLOCK) {
+        const int64_t n = std::min(PROJECTION_ROW_BLOCK, rows - r);
+        u = MatMap(basis + r, n, cols, Eigen::OuterStride<>(ld)).template cast<T>();
+        OutMap(out + r, n, count, Eigen::OuterStride<>(rows)).noalias() = u * w;
+    }
+}
+
+/// Columns a fixed size kernel (see project_fixed()) works on at once.
+constexpr int FIXED_TILE = 8;
+/// Rows per block of the fixed size kernels: a block of delta (or out)
+/// stays in L1 while all tiles of columns go through it.
+constexpr int64_t FIXED_ROW_BLOCK = 1024;
+
+namespace detail {
+/// Values of T per SIMD register Eigen was compiled for.
+template<typename T>
+constexpr int fixed_lanes() { return Eigen::internal::packet_traits<T>::size; }
+} // end of detail namespace
+
+/// project() for a basis with exactly K columns. Rows are taken a block at
+/// a time, columns a tile of FIXED_TILE at a time: a tile's per lane
+/// partial sums live in fixed size arrays the compiler keeps in vector
+/// registers, K x lanes of them are carried between row blocks on the
+/// stack and reduced into weights at the end. No loop bound depends on K
+/// at runtime, nothing is allocated.
+template<int K, typename S, typename T>
+void project_fixed(const S * basis, int64_t ld, int64_t rows, const T * delta, T * weights)
+{
+    static_assert(K % FIXED_TILE == 0, "Fixed kernels take whole tiles.");
+    constexpr int L = detail::fixed_lanes<T>();
+    T partial[K][L] = {};
+    for (int64_t r0 = 0; r0 < rows; r0 += FIXED_ROW_BLOCK) {
+        const int64_t n    = std::min(FIXED_ROW_BLOCK, rows - r0);
+        const int64_t body = n - n % L;
+        const T * d = delta + r0;
+        for (int c0 = 0; c0 < K; c0 += FIXED_TILE) {
+            const S * u[FIXED_TILE];
+            T acc[FIXED_TILE][L];
+            for (int t = 0; t < FIXED_TILE; ++t) {
+                u[t] = basis + (c0 + t)*ld + r0;
+                for (int l = 0; l < L; ++l)
+                    acc[t][l] = partial[c0 + t][l];
+            }
+            for (int64_t r = 0; r < body; r += L)
+                for (int t = 0; t < FIXED_TILE; ++t)
+                    for (int l = 0; l < L; ++l)
+                        acc[t][l] += T(u[t][r + l]) * d[r + l];
+            for (int64_t r = body; r < n; ++r)
+                for (int t = 0; t < FIXED_TILE; ++t)
+                    acc[t][0] += T(u[t][r]) * d[r];
+            for (int t = 0; t < FIXED_TILE; ++t)
+                for (int l = 0; l < L; ++l)
+                    partial[c0 + t][l] = acc[t][l];
+        }
+    }
+    for (int c = 0; c < K; ++c) {
+        T sum = 0;
+        for (int l = 0; l < L; ++l)
+            sum += partial[c][l];
+        weights[c] += sum;
+    }
+}
+
+/// reconstruct() for a basis with exactly K columns: weights are copied to
+/// a stack array, and a row block of out (in L1) accumulates one tile of
+/// columns after another, so out goes to memory once rather than once per
+/// column group and only FIXED_TILE columns are streamed at a time.
+template<int K, typename S, typename T>
+void reconstruct_fixed(const S * basis, int64_t ld, int64_t rows, const T * weights, T * out)
+{
+    static_assert(K % FIXED_TILE == 0, "Fixed kernels take whole tiles.");
+    constexpr int L = detail::fixed_lanes<T>();
+    T w[K];
+    for (int c = 0; c < K; ++c)
+        w[c] = weights[c];
+    for (int64_t r0 = 0; r0 < rows; r0 += FIXED_ROW_BLOCK) {
+        const int64_t n    = std::min(FIXED_ROW_BLOCK, rows - r0);
+        const int64_t body = n - n % L;
+        T * o = out + r0;
+        for (int c0 = 0; c0 < K; c0 += FIXED_TILE) {
+            const S * u[FIXED_TILE];
+            for (int t = 0; t < FIXED_TILE; ++t)
+                u[t] = basis + (c0 + t)*ld + r0;
+            for (int64_t r = 0; r < body; r += L) {
+                T acc[L];
+                for (int l = 0; l < L; ++l)
+                    acc[l] = c0 ? o[r + l] : T(0);
+                for (int t = 0; t < FIXED_TILE; ++t)
+                    for (int l = 0; l < L; ++l)
+                        acc[l] += w[c0 + t] * T(u[t][r + l]);
+                for (int l = 0; l < L; ++l)
+                    o[r + l] = acc[l];
+            }
+            for (int64_t r = body; r < n; ++r) {
+                T acc = c0 ? o[r] : T(0);
+                for (int t = 0; t < FIXED_TILE; ++t)
+                    acc += w[c0 + t] * T(u[t][r]);
+                o[r] = acc;
+            }
+        }
+    }
+}
+
+/// True if there are fixed size kernels for 'cols' columns.
+inline bool has_fixed_kernels(int64_t cols) {
+    return cols == 8 || cols == 16 || cols == 24 || cols == 32 || cols == 48 || cols == 64;
+}
+
+/// Calls KERNEL<K>(...) if cols is one of the sizes with fixed kernels
+/// (8, 16, 24, 32, 48, 64) and returns true, otherwise returns false for
+/// the caller to run the dynamic kernel.
+#define SUBDEFORM_FIXED_DISPATCH(cols, KERNEL, ...)                    \
+    switch (cols) {                                                   \
+        case 8:  KERNEL<8>(__VA_ARGS__);  return true;                \
+        case 16: KERNEL<16>(__VA_ARGS__); return true;                \
+        case 24: KERNEL<24>(__VA_ARGS__); return true;                \
+        case 32: KERNEL<32>(__VA_ARGS__); return true;                \
+        case 48: KERNEL<48>(__VA_ARGS__); return true;                \
+        case 64: KERNEL<64>(__VA_ARGS__); return true;                \
+        default: return false;                                        \
+    }
+
+/// Runs project_fixed() if there is one for cols. Returns false otherwise.
+template<typename S, typename T>
+bool project_fixed(const S * basis, int64_t ld, int64_t rows, int64_t cols,
+    const T * delta, T * weights)
+{
+    SUBDEFORM_FIXED_DISPATCH(cols, project_fixed, basis, ld, rows, delta, weights)
+}
+
+/// Runs reconstruct_fixed() if there is one for cols. Returns false otherwise.
+template<typename S, typename T>
+bool reconstruct_fixed(const S * basis, int64_t ld, int64_t rows, int64_t cols,
+    const T * weights, T * out)
+{
+    SUBDEFORM_FIXED_DISPATCH(cols, reconstruct_fixed, basis, ld, rows, weights, out)
+}
+
+#undef SUBDEFORM_FIXED_DISPATCH
+
+/// Kernel selection of SubspaceBasis: fixed size kernels (if 'fixed' and
+/// there is one for cols) for bases stored in T, dynamic ones for bases
+/// converted on the fly, whose cost is the conversion, not loop overhead.
+template<typename S, typename T>
+void project_rows(const S * basis, int64_t ld, int64_t rows, int64_t cols,
+    const T * delta, T * weights, bool)
+{
+    project(basis, ld, rows, cols, delta, weights);
+}
+
+template<typename T>
+void project_rows(const T * basis, int64_t ld, int64_t rows, int64_t cols,
+    const T * delta, T * weights, bool fixed)
+{
+    if (!fixed || !project_fixed(basis, ld, rows, cols, delta, weights))
+        project(basis, ld, rows, cols, delta, weights);
+}
+
+/// See project_rows().
+template<typename S, typename T>
+void reconstruct_rows(const S * basis, int64_t ld, int64_t rows, int64_t cols,
+    const T * weights, T * out, bool)
+{
+    reconstruct(basis, ld, rows, cols, weights, out);
+}
+
+template<typename T>
+void reconstruct_rows(const T * basis, int64_t ld, int64_t rows, int64_t cols,
+    const T * weights, T * out, bool fixed)
+{
+    if (!fixed || !reconstruct_fixed(basis, ld, rows, cols, weights, out))
+        reconstruct(basis, ld, rows, cols, weights, out);
+}
+
+/// Column major basis quantized to Q (int16_t or int8_t): element (r, c) is
+/// data[r + c*ld] * scales[c*blocks + (row + r) / scale_rows]. 'row' is the
+/// basis row 'data' points at, so the kernels below can take row blocks of it
+/// the same way they take (pointer + row) of float bases.
+template<typename Q>
+struct QuantizedBasis {
+    const Q *     data;
+    const float * scales;
+    int64_t       scale_rows;
+    int64_t       blocks;     // scales per column
+    int64_t       row;
+
+    QuantizedBasis operator+(int64_t offset) const {
+        return QuantizedBasis{data + offset, scales, scale_rows, blocks, row + offset};
+    }
+};
+
+/// Rows of a quantized column dequantized at once, small enough for the
+/// buffer to stay in L1 next to the delta it is multiplied with.
+constexpr int64_t QUANTIZED_ROW_BLOCK = 512;
+
+namespace detail {
+template<typename Q, typename T>
+inline void dequantize(const Q * __restrict q, const T scale, const int64_t n, T * __restrict out) {
+    for (int64_t i = 0; i < n; ++i)
+        out[i] = T(q[i]) * scale;
+}
+
+template<typename Q, typename T>
+inline void accumulate(const Q * __restrict q, const T scale, const int64_t n, T * __restrict out) {
+    for (int64_t i = 0; i < n; ++i)
+        out[i] += T(q[i]) * scale;
+}
+
+/// Calls fn(r, n, block) for consecutive row ranges [r, r+n) of at most
+/// 'limit' rows which don't cross a scale block.
+template<typename Q, typename F>
+inline void for_each_scale_range(const QuantizedBasis<Q> & basis, int64_t rows, int64_t limit, F fn) {
+    for (int64_t r = 0; r < rows; ) {
+        const int64_t absolute = basis.row + r;
+        const int64_t block    = absolute / basis.scale_rows;
+        const int64_t n = std::min(std::min(limit, rows - r), (block + 1)*basis.scale_rows - absolute);
+        fn(r, n, block);
+        r += n;
+    }
+}
+} // end of detail namespace
+
+/// Quantized project(): each column range is widened and scaled into an L1
+/// buffer by a vectorized loop, then dotted with delta.
+template<typename Q, typename T>
+void project(const QuantizedBasis<Q> & basis, int64_t ld, int64_t rows, int64_t cols,
+    const T * delta, T * weights)
+{
+    using VecMap = Eigen::Map<const Eigen::Matrix<T, Eigen::Dynamic, 1> >;
+    T buffer[QUANTIZED_ROW_BLOCK];
+    detail::for_each_scale_range(basis, rows, QUANTIZED_ROW_BLOCK,
+        [&](int64_t r, int64_t n, int64_t block) {
+            const VecMap d(delta + r, n);
+            for (int64_t c = 0; c < cols; ++c) {
+                detail::dequantize(basis.data + c*ld + r, T(basis.scales[c*basis.blocks + block]),
+                    n, buffer);
+                weights[c] += VecMap(buffer, n).dot(d);
+            }
+        });
+}
+
+/// Quantized reconstruct(): scale is folded into the weight, so a column
+/// costs one widening multiply-add per row.
+template<typename Q, typename T>
+void reconstruct(const QuantizedBasis<Q> & basis, int64_t ld, int64_t rows, int64_t cols,
+    const T * weights, T * out)
+{
+    for (int64_t r = 0; r < rows; ++r)
+        out[r] = 0;
+    detail::for_each_scale_range(basis, rows, rows,
+        [&](int64_t r, int64_t n, int64_t block) {
+            for (int64_t c = 0; c < cols; ++c) {
+                detail::accumulate(basis.data + c*ld + r,
+                    T(weights[c] * basis.scales[c*basis.blocks + block]), n, out + r);
+            }
+        });
+}
+
+/// Quantized bases always take the dynamic kernels (see project_rows()).
+template<typename Q, typename T>
+void project_rows(const QuantizedBasis<Q> & basis, int64_t ld, int64_t rows, int64_t cols,
+    const T * delta, T * weights, bool)
+{
+    project(basis, ld, rows, cols, delta, weights);
+}
+
+template<typename Q, typename T>
+void reconstruct_rows(const QuantizedBasis<Q> & basis, int64_t ld, int64_t rows, int64_t cols,
+    const T * weights, T * out, bool)
+{
+    reconstruct(basis, ld, rows, cols, weights, out);
+}
+
+namespace detail {
+/// Dequantizes rows [r, r+n) (one scale block) of all columns into u.
+template<typename Q, typename T>
+inline void dequantize_rows(const QuantizedBasis<Q> & basis, int64_t ld, int64_t cols,
+    int64_t r, int64_t n, int64_t block, Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> & u) {
+    u.resize(n, cols);
+    for (int64_t c = 0; c < cols; ++c) {
+        dequantize(basis.data + c*ld + r, T(basis.scales[c*basis.blocks + block]), n,
+            u.col(c).data());
+    }
+}
+} // end of detail namespace
+
+/// Quantized project_block(), dequantizing a row block at a time like the
+/// mixed type path.
+template<typename Q, typename T>
+void project_block(const QuantizedBasis<Q> & basis, int64_t ld, int64_t rows, int64_t cols,
+    const T * delta, int64_t count, T * weights)
+{
+    using Block    = Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>;
+    using DeltaMap = Eigen::Map<const Block, 0, Eigen::OuterStride<> >;
+    Eigen::Map<Block> w(weights, cols, count);
+    Block u;
+    detail::for_each_scale_range(basis, rows, PROJECTION_ROW_BLOCK,
+        [&](int64_t r, int64_t n, int64_t block) {
+            detail::dequantize_rows(basis, ld, cols, r, n, block, u);
+            w.noalias() += u.transpose() * DeltaMap(delta + r, n, count, Eigen::OuterStride<>(rows));
+        });
+}
+
+/// Quantized reconstruct_block().
+template<typename Q, typename T>
+void reconstruct_block(const QuantizedBasis<Q> & basis, int64_t ld, int64_t rows, int64_t cols,
+    const T * weights, int64_t count, T * out)
+{
+    using Block  = Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>;
+    using OutMap = Eigen::Map<Block, 0, Eigen::OuterStride<> >;
+    const Eigen::Map<const Block> w(weights, cols, count);
+    Block u;
+    detail::for_each_scale_range(basis, rows, PROJECTION_ROW_BLOCK,
+        [&](int64_t r, int64_t n, int64_t block) {
+            detail::dequantize_rows(basis, ld, cols, r, n, block, u);
+            OutMap(out + r, n, count, Eigen::OuterStride<>(rows)).noalias() = u * w;
+        });
+}
+
+} // end of subdeform namespace
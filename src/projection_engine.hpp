@@ -0,0 +1,229 @@
+#pragma once
+#include <GU/GU_Detail.h>
+#include <GA/GA_PageHandle.h>
+#include <UT/UT_Array.h>
+#include <UT/UT_ParallelUtil.h>
+#include "basis.hpp"
+#include "point_access.hpp"
+#include "profile.hpp"
+#include "region_basis.hpp"
+
+namespace subdeform {
+
+/// Unscaled displacement per row of a PointMap.
+using Displacement = UT_Array<UT_Vector3>;
+
+/// Two pass, transpose free projection of point deltas onto a subspace:
+///
+///   pass 1: weights  = U^T * (P - rest), accumulated chunk by chunk
+///   pass 2: P       += scale * U * weights, written back chunk by chunk
+///
+/// Basis rows follow a PointMap: all points by number, or the members of
+/// a group for a sub-basis gathered with their rows (see
+/// SOP_Subdeform::updateGroupMatrix()).
+///
+/// Pass 2 can also keep the unscaled displacement U * weights, so a cook
+/// where only the scale changed reapplies it (displace_cached()) without
+/// touching the basis.
+///
+/// Both passes read and write P and rest in page runs (see point_access.hpp)
+/// and only keep a page sized delta/displacement block around, so a cook
+/// makes one sweep over the basis per pass and no 3N temporaries. Rows of
+/// a chunk are contiguous in the basis whatever the point order, so every
+/// chunk is one blocked kernel call.
+///
+/// Chunks are distributed over Houdini's task scheduler. Each chunk writes
+/// its partial U^T * delta into its own column, and columns are summed in
+/// chunk order afterwards, so results are bitwise identical for any number
+/// of threads.
+///
+/// With a Profile set, passes add their time split into delta gather /
+/// U^T * delta and U * weights / scatter (timed per chunk, see FusedStages).
+template<typename T>
+class ProjectionEngine
+{
+public:
+    using Weights  = Eigen::Matrix<T, Eigen::Dynamic, 1>;
+    using Partials = Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>;
+
+    /// Profile passes add to (nullptr: no timing).
+    void setProfile(Profile * profile) { m_profile = profile; }
+
+    /// Computes weights = U^T * (P - rest). Returns false without rest.
+    bool project(const SubspaceBasis & basis, const GU_Detail * gdp, 
+        const PointMap & points, Weights & weights) {
+        const GA_Attribute * rest = gdp->findFloatTuple(GA_ATTRIB_POINT, "rest", 3);
+        if (!rest)
+            return false;
+        weights.setZero(basis.cols());
+        const exint nchunks = point_chunks(points.size());
+        m_partials.setZero(basis.cols(), nchunks);
+        if (m_profile)
+            m_profile->alloc_bytes += m_partials.size() * sizeof(T);
+        FusedStages stages(m_profile, Stage::Delta, Stage::Project);
+
+        parallel_point_chunks(points.size(), 
+            [&](const exint chunk, const GA_Index first, const GA_Index last) {
+            T block[3*GA_PAGE_SIZE];
+            const auto t0 = stages.now();
+            read_point_deltas(gdp->getP(), rest, points, first, last, block);
+            const auto t1 = stages.now();
+            basis.projectRows(3*first, 3*(last - first), block, m_partials.col(chunk).data());
+            stages.add(t1 - t0, stages.now() - t1);
+        });
+
+        // Fixed order reduction.
+        for (exint chunk = 0; chunk < nchunks; ++chunk)
+            weights += m_partials.col(chunk);
+        return true;
+    }
+
+    /// P += scale * U * weights, U * weights is kept in 'cache' (by row) if
+    /// given.
+    void displace(const SubspaceBasis & basis, const Weights & weights,
+        const float scale, const PointMap & points, GU_Detail * gdp, 
+        Displacement * cache=nullptr) {
+        if (cache)
+            cache->setSizeNoInit(points.size());
+        prepare_point_writes(gdp->getP(), points);
+        FusedStages stages(m_profile, Stage::Reconstruct, Stage::Scatter);
+
+        parallel_point_chunks(points.size(), 
+            [&](const exint, const GA_Index first, const GA_Index last) {
+            T block[3*GA_PAGE_SIZE];
+            const auto t0 = stages.now();
+            basis.reconstructRows(3*first, 3*(last - first), weights.data(), block);
+            const auto t1 = stages.now();
+            add_points(gdp->getP(), points, first, last, block, scale);
+            if (cache) {
+                const T * d = block;
+                for (GA_Index row = first; row < last; ++row, d += 3)
+                    (*cache)(row) = UT_Vector3(d[0], d[1], d[2]);
+            }
+            stages.add(t1 - t0, stages.now() - t1);
+        });
+    }
+
+    /// P = rest + scale * U * weights, for weights known upfront (e.g. read
+    /// from a WeightStream): input P is overwritten, not read. Returns false
+    /// without rest.
+    bool reconstruct(const SubspaceBasis & basis, const Weights & weights,
+        const float scale, const PointMap & points, GU_Detail * gdp) {
+        const GA_Attribute * rest = gdp->findFloatTuple(GA_ATTRIB_POINT, "rest", 3);
+        if (!rest)
+            return false;
+        {
+            ScopedStage stage(m_profile, Stage::Scatter);
+            prepare_point_writes(gdp->getP(), points);
+            parallel_point_chunks(points.size(), 
+                [&](const exint, const GA_Index first, const GA_Index last) {
+                float block[3*GA_PAGE_SIZE];
+                read_points(rest, points, first, last, block);
+                write_points(gdp->getP(), points, first, last, block);
+            });
+        }
+        displace(basis, weights, scale, points, gdp);
+        return true;
+    }
+
+    /// Block-sparse variant: every region projects and reconstructs its own
+    /// points with its own basis,
+    ///
+    ///   displacement = sum_r blend_r * U_r * U_r^T * (P - rest)_r
+    ///
+    /// kept by point number ('points' maps all points, apply it with
+    /// displace_cached()). Regions are tasks of their own (a region's
+    /// kernels run on one thread) and their blended displacements are
+    /// summed in region order afterwards, so results don't depend on thread
+    /// count. Returns false without rest.
+    bool projectRegions(const RegionBasis & regions, const GU_Detail * gdp,
+        const PointMap & points, Displacement & displacement) {
+        const GA_Attribute * rest = gdp->findFloatTuple(GA_ATTRIB_POINT, "rest", 3);
+        if (!rest)
+            return false;
+        const exint nregions = regions.size();
+        // Per region: 3 N_r deltas (then displacements) and K_r weights.
+        m_regional.resize(nregions);
+        size_t scratch = 0;
+        for (exint r = 0; r < nregions; ++r) {
+            const RegionBasis::Region & region = regions.region(r);
+            m_regional[r].resize(3*region.points.size() + region.basis.cols());
+            scratch += m_regional[r].size();
+        }
+        if (m_profile)
+            m_profile->alloc_bytes += scratch * sizeof(T);
+
+        {
+            FusedStages stages(m_profile, Stage::Delta, Stage::Project);
+            UTparallelForEachNumber(nregions, [&](const UT_BlockedRange<exint> & range) {
+                GA_ROPageHandleV3 P_ph(gdp->getP());
+                GA_ROPageHandleV3 rest_ph(rest);
+                ProfileClock::duration gather(0), kernel(0);
+                for (exint r = range.begin(); r != range.end(); ++r) {
+                    const RegionBasis::Region & region = regions.region(r);
+                    const int64_t count = region.points.size();
+                    T * delta = m_regional[r].data();
+                    const auto t0 = stages.now();
+                    // Region points are scattered, pages are only switched
+                    // when a point lies on another one.
+                    for (int64_t i = 0; i < count; ++i) {
+                        const GA_Offset ptoff = points.offset(GA_Index(region.points[i]));
+                        P_ph.setPage(ptoff);
+                        rest_ph.setPage(ptoff);
+                        const UT_Vector3 d = P_ph.get(ptoff) - rest_ph.get(ptoff);
+                        delta[3*i + 0] = d.x(); delta[3*i + 1] = d.y(); delta[3*i + 2] = d.z();
+                    }
+                    const auto t1 = stages.now();
+                    region.basis.project(delta, delta + 3*count);
+                    gather += t1 - t0;
+                    kernel += stages.now() - t1;
+                }
+                stages.add(gather, kernel);
+            });
+        }
+        {
+            ScopedStage stage(m_profile, Stage::Reconstruct);
+            UTparallelForEachNumber(nregions, [&](const UT_BlockedRange<exint> & range) {
+                for (exint r = range.begin(); r != range.end(); ++r) {
+                    const RegionBasis::Region & region = regions.region(r);
+                    // Displacement overwrites the region's delta.
+                    T * buffer = m_regional[r].data();
+                    region.basis.reconstruct(buffer + 3*region.points.size(), buffer);
+                }
+            });
+        }
+
+        ScopedStage stage(m_profile, Stage::Scatter);
+        displacement.setSize(points.size());
+        displacement.constant(UT_Vector3(0, 0, 0));
+        for (exint r = 0; r < nregions; ++r) {
+            const RegionBasis::Region & region = regions.region(r);
+            const T * d = m_regional[r].data();
+            for (size_t i = 0; i < region.points.size(); ++i, d += 3)
+                displacement(region.points[i]) += UT_Vector3(d[0], d[1], d[2]) * region.blend[i];
+        }
+        return true;
+    }
+
+private:
+    /// basis.cols() x chunks, one partial U^T * delta per chunk.
+    Partials m_partials;
+    /// Delta/displacement and weights of each region (projectRegions()).
+    std::vector<std::vector<T> > m_regional;
+    Profile *m_profile = nullptr;
+};
+
+/// P += scale * displacement, with displacement kept by displace() for
+/// the same rows. Same arithmetic as displace(), so results match a full
+/// cook bit for bit.
+inline void displace_cached(const Displacement & displacement, const float scale,
+    const PointMap & points, GU_Detail * gdp) {
+    prepare_point_writes(gdp->getP(), points);
+    const float * values = displacement.isEmpty() ? nullptr : displacement(0).data();
+    parallel_point_chunks(points.size(), 
+        [&](const exint, const GA_Index first, const GA_Index last) {
+        add_points(gdp->getP(), points, first, last, values, scale);
+    });
+}
+
+} // end of subdeform namespace
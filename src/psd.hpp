@@ -0,0 +1,125 @@
+#pragma once
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+namespace subdeform {
+
+/// Per point tangent frames stored as structure of arrays (x, y, z planes
+/// of tangentu and tangentv), indexed by point number.
+struct TangentFrames {
+    std::vector<float> u[3];
+    std::vector<float> v[3];
+
+    void resize(size_t count) {
+        for (int axis = 0; axis < 3; ++axis) {
+            u[axis].assign(count, 0.f);
+            v[axis].assign(count, 0.f);
+        }
+    }
+    size_t size() const { return u[0].size(); }
+    bool   empty() const { return u[0].empty(); }
+
+    /// Normalizes all tangents in place, degenerate ones become zero.
+    void normalize() {
+        for (std::vector<float> * plane : {u, v}) {
+            for (size_t i = 0; i < size(); ++i) {
+                const float length2 = plane[0][i]*plane[0][i] + plane[1][i]*plane[1][i]
+                    + plane[2][i]*plane[2][i];
+                const float scale = length2 > 1e-12f ? 1.f / std::sqrt(length2) : 0.f;
+                for (int axis = 0; axis < 3; ++axis)
+                    plane[axis][i] *= scale;
+            }
+        }
+    }
+};
+
+namespace detail {
+/// Rotation about axis w applied to x in Rodrigues form for a minimal arc
+/// a -> b of unit vectors: c x + w × x + (w·x) w / (1 + c), w = a × b,
+/// c = a·b. c = 1, w = 0 is the identity.
+inline void rotate_arc(const float w[3], float c, float x[3]) {
+    const float wx   = (w[0]*x[0] + w[1]*x[1] + w[2]*x[2]) / (1.f + c);
+    const float r[3] = {
+        c*x[0] + w[1]*x[2] - w[2]*x[1] + wx*w[0],
+        c*x[1] + w[2]*x[0] - w[0]*x[2] + wx*w[1],
+        c*x[2] + w[0]*x[1] - w[1]*x[0] + wx*w[2],
+    };
+    x[0] = r[0]; x[1] = r[1]; x[2] = r[2];
+}
+
+/// Normalizes a (returns its squared length) and sets up the arc a -> b.
+inline float arc_setup(float a[3], const float b[3], float w[3], float & c) {
+    const float length2 = a[0]*a[0] + a[1]*a[1] + a[2]*a[2];
+    // Biased rather than tested: tests turn into branches in the loop.
+    const float scale = 1.f / std::sqrt(length2 + 1e-30f);
+    a[0] *= scale; a[1] *= scale; a[2] *= scale;
+    w[0] = a[1]*b[2] - a[2]*b[1];
+    w[1] = a[2]*b[0] - a[0]*b[2];
+    w[2] = a[0]*b[1] - a[1]*b[0];
+    c    = a[0]*b[0] + a[1]*b[1] + a[2]*b[2];
+    return length2;
+}
+} // end of detail namespace
+
+namespace detail {
+/// Loop of rotate_to_rest() over plane pointers. Restrict qualified
+/// parameters (locals don't count) spare the vectorizer runtime alias
+/// checks between all fifteen planes.
+inline void rotate_to_rest_planes(int64_t count,
+    const float * __restrict rux, const float * __restrict ruy, const float * __restrict ruz,
+    const float * __restrict rvx, const float * __restrict rvy, const float * __restrict rvz,
+    const float * __restrict sux, const float * __restrict suy, const float * __restrict suz,
+    const float * __restrict svx, const float * __restrict svy, const float * __restrict svz,
+    float * __restrict dx, float * __restrict dy, float * __restrict dz)
+{
+    const float eps = 1e-6f;
+    for (int64_t i = 0; i < count; ++i) {
+        float a[3] = {sux[i], suy[i], suz[i]};
+        float b[3] = {svx[i], svy[i], svz[i]};
+        const float ru[3] = {rux[i], ruy[i], ruz[i]};
+        const float rv[3] = {rvx[i], rvy[i], rvz[i]};
+        float wu[3], wv[3], cu, cv;
+        const float la = arc_setup(a, ru, wu, cu);
+        const float lb = arc_setup(b, rv, wv, cv);
+        // Degenerate points get the identity (c = 1, w = 0) instead of a
+        // branch; bitwise and avoids short circuit branches too.
+        const float valid = (la > eps) & (lb > eps) & (1.f + cu > eps) & (1.f + cv > eps)
+            & (ru[0]*ru[0] + ru[1]*ru[1] + ru[2]*ru[2] > 0.5f)
+            & (rv[0]*rv[0] + rv[1]*rv[1] + rv[2]*rv[2] > 0.5f);
+        for (int axis = 0; axis < 3; ++axis) {
+            wu[axis] *= valid;
+            wv[axis] *= valid;
+        }
+        cu = valid * cu + (1.f - valid);
+        cv = valid * cv + (1.f - valid);
+
+        float x[3] = {dx[i], dy[i], dz[i]};
+        rotate_arc(wu, cu, x);
+        rotate_arc(wv, cv, x);
+        dx[i] = x[0];
+        dy[i] = x[1];
+        dz[i] = x[2];
+    }
+}
+} // end of detail namespace
+
+/// Brings skin space deltas (x, y, z planes, rotated in place) back to rest
+/// space: first by the rotation taking skin tangentu onto rest tangentu,
+/// then by the one taking skin tangentv onto rest tangentv (what the
+/// UT_Matrix3::dihedral(skin_tu, rest_tu) * dihedral(skin_tv, rest_tv)
+/// product did per point). Rest frames must be normalized, skin ones are
+/// normalized here. Points with a zero length or opposite tangent keep
+/// their delta. Planes must not overlap.
+inline void rotate_to_rest(int64_t count,
+    const float * const rest_u[3], const float * const rest_v[3],
+    const float * const skin_u[3], const float * const skin_v[3],
+    float * const delta[3])
+{
+    detail::rotate_to_rest_planes(count,
+        rest_u[0], rest_u[1], rest_u[2], rest_v[0], rest_v[1], rest_v[2],
+        skin_u[0], skin_u[1], skin_u[2], skin_v[0], skin_v[1], skin_v[2],
+        delta[0], delta[1], delta[2]);
+}
+
+} // end of subdeform namespace
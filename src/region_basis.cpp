@@ -0,0 +1,375 @@
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <thread>
+#include <unordered_map>
+#include "region_basis.hpp"
+
+namespace subdeform {
+
+namespace {
+
+constexpr int64_t REGION_POINT_BLOCK = 8192; // points per parallel task
+
+/// 'count' elements of 'size' bytes at 'offset' lie within 'limit' bytes,
+/// checked without sums or products which could wrap around.
+bool fits(uint64_t offset, uint64_t count, uint64_t size, uint64_t limit) {
+    return offset <= limit && count <= (limit - offset) / size;
+}
+
+/// Calls fn(first, count, block) for fixed point blocks on all cores.
+template<typename Fn>
+void parallel_point_blocks(int64_t points, const Fn & fn) {
+    const int64_t blocks  = (points + REGION_POINT_BLOCK - 1) / REGION_POINT_BLOCK;
+    const int64_t threads = std::min<int64_t>(blocks,
+        std::max(1u, std::thread::hardware_concurrency()));
+    std::atomic<int64_t> next(0);
+    auto worker = [&]() {
+        for (int64_t b = next++; b < blocks; b = next++)
+            fn(b * REGION_POINT_BLOCK, std::min(REGION_POINT_BLOCK, points - b * REGION_POINT_BLOCK), b);
+    };
+    std::vector<std::thread> pool;
+    for (int64_t t = 1; t < threads; ++t)
+        pool.emplace_back(worker);
+    worker();
+    for (auto & thread : pool)
+        thread.join();
+}
+
+/// Uniform grid cell of a position, packed into one key (21 bits per axis,
+/// wrapping cells only cost extra distance tests).
+int64_t cell_key(const int64_t x, const int64_t y, const int64_t z) {
+    constexpr int64_t mask = (int64_t(1) << 21) - 1;
+    return ((x & mask) << 42) | ((y & mask) << 21) | (z & mask);
+}
+
+/// A point's share of one region.
+struct Membership {
+    int64_t point;
+    int     region;
+    float   weight;
+};
+
+bool pad_to_page(FILE * file) {
+    const long position = ftell(file);
+    if (position < 0)
+        return false;
+    const uint64_t aligned = (position + MATRIX_PAGE_SIZE - 1) / MATRIX_PAGE_SIZE * MATRIX_PAGE_SIZE;
+    const std::vector<char> padding(aligned - position, 0);
+    return fwrite(padding.data(), 1, padding.size(), file) == padding.size();
+}
+
+} // end of anonymous namespace
+
+bool is_region_basis(const char * filename) {
+    FILE * file = fopen(filename, "rb");
+    if (!file)
+        return false;
+    char magic[8] = {};
+    const bool read = fread(magic, 1, sizeof(magic), file) == sizeof(magic);
+    fclose(file);
+    return read && memcmp(magic, REGION_MAGIC, sizeof(magic)) == 0;
+}
+
+std::vector<int> cluster_points(const Matrix & positions, int clusters, int iterations) {
+    const int64_t npoints = positions.rows();
+    std::vector<int> labels(npoints, 0);
+    clusters = int(std::min<int64_t>(clusters, npoints));
+    if (clusters <= 1)
+        return labels;
+
+    // Farthest point sampling, starting at the point nearest the mean.
+    Matrix centroids(clusters, 3);
+    const Eigen::RowVector3d mean = positions.colwise().mean();
+    Vector nearest = (positions.rowwise() - mean).rowwise().squaredNorm();
+    Eigen::Index seed;
+    nearest.minCoeff(&seed);
+    centroids.row(0) = positions.row(seed);
+    nearest = (positions.rowwise() - centroids.row(0)).rowwise().squaredNorm();
+    for (int c = 1; c < clusters; ++c) {
+        nearest.maxCoeff(&seed);
+        centroids.row(c) = positions.row(seed);
+        nearest = nearest.cwiseMin((positions.rowwise() - centroids.row(c)).rowwise().squaredNorm());
+    }
+
+    // Lloyd iterations. Labels are per point, centroids are summed in point
+    // order, so clusters don't depend on thread count.
+    for (int iteration = 0; iteration < iterations; ++iteration) {
+        std::atomic<bool> changed(false);
+        parallel_point_blocks(npoints, [&](int64_t first, int64_t count, int64_t) {
+            bool block_changed = false;
+            for (int64_t i = first; i < first + count; ++i) {
+                Eigen::Index label;
+                (centroids.rowwise() - positions.row(i)).rowwise().squaredNorm().minCoeff(&label);
+                block_changed |= labels[i] != int(label);
+                labels[i] = int(label);
+            }
+            if (block_changed)
+                changed = true;
+        });
+        if (!changed && iteration > 0)
+            break;
+        Matrix sums = Matrix::Zero(clusters, 3);
+        Vector counts = Vector::Zero(clusters);
+        for (int64_t i = 0; i < npoints; ++i) {
+            sums.row(labels[i]) += positions.row(i);
+            counts[labels[i]] += 1;
+        }
+        // Empty clusters keep their centroid.
+        for (int c = 0; c < clusters; ++c) {
+            if (counts[c] > 0)
+                centroids.row(c) = sums.row(c) / counts[c];
+        }
+    }
+    return labels;
+}
+
+std::vector<RegionPoints> build_regions(const Matrix & positions,
+    const std::vector<int> & labels, double overlap) {
+    const int64_t npoints = positions.rows();
+    // Regions in label order, whatever values labels use.
+    std::map<int, int> region_of;
+    for (const int label : labels) {
+        if (label >= 0)
+            region_of.emplace(label, 0);
+    }
+    int nregions = 0;
+    for (auto & entry : region_of)
+        entry.second = nregions++;
+    std::vector<int> region(npoints, -1);
+    for (int64_t i = 0; i < npoints; ++i) {
+        if (labels[i] >= 0)
+            region[i] = region_of[labels[i]];
+    }
+
+    std::vector<RegionPoints> regions(nregions);
+    if (overlap <= 0) {
+        for (int64_t i = 0; i < npoints; ++i) {
+            if (region[i] < 0)
+                continue;
+            regions[region[i]].points.push_back(i);
+            regions[region[i]].blend.push_back(1.0f);
+        }
+    } else {
+        // Grid of 'overlap' sized cells: points closer than overlap to a
+        // point are in its cell or one of the 26 around it.
+        std::unordered_map<int64_t, std::vector<int64_t> > grid;
+        Eigen::Matrix<int64_t, Eigen::Dynamic, 3> cells(npoints, 3);
+        for (int64_t i = 0; i < npoints; ++i) {
+            for (int axis = 0; axis < 3; ++axis)
+                cells(i, axis) = int64_t(std::floor(positions(i, axis) / overlap));
+            if (region[i] >= 0)
+                grid[cell_key(cells(i, 0), cells(i, 1), cells(i, 2))].push_back(i);
+        }
+        const int64_t nblocks = (npoints + REGION_POINT_BLOCK - 1) / REGION_POINT_BLOCK;
+        std::vector<std::vector<Membership> > memberships(nblocks);
+        parallel_point_blocks(npoints, [&](int64_t first, int64_t count, int64_t block) {
+            std::vector<Membership> & out = memberships[block];
+            std::vector<double> nearest(nregions);
+            for (int64_t i = first; i < first + count; ++i) {
+                std::fill(nearest.begin(), nearest.end(), overlap);
+                for (int64_t dx = -1; dx <= 1; ++dx)
+                for (int64_t dy = -1; dy <= 1; ++dy)
+                for (int64_t dz = -1; dz <= 1; ++dz) {
+                    const auto cell = grid.find(cell_key(cells(i, 0) + dx,
+                        cells(i, 1) + dy, cells(i, 2) + dz));
+                    if (cell == grid.end())
+                        continue;
+                    for (const int64_t other : cell->second) {
+                        const int r = region[other];
+                        if (r == region[i])
+                            continue;
+                        nearest[r] = std::min(nearest[r],
+                            (positions.row(other) - positions.row(i)).norm());
+                    }
+                }
+                // Own region weighs 1, overlapping ones fall off with
+                // distance; weights are normalized where they sum past 1
+                // (points of no region keep the falloff).
+                const size_t begin = out.size();
+                double total = 0;
+                for (int r = 0; r < nregions; ++r) {
+                    const double weight = r == region[i] ? 1.0 : 1.0 - nearest[r] / overlap;
+                    if (weight <= 0)
+                        continue;
+                    out.push_back(Membership{i, r, float(weight)});
+                    total += weight;
+                }
+                for (size_t m = begin; total > 1 && m < out.size(); ++m)
+                    out[m].weight = float(out[m].weight / total);
+            }
+        });
+        // Blocks are in point order, so region point lists come out ascending.
+        for (const auto & block : memberships) {
+            for (const Membership & member : block) {
+                regions[member.region].points.push_back(member.point);
+                regions[member.region].blend.push_back(member.weight);
+            }
+        }
+    }
+
+    std::vector<RegionPoints> kept;
+    for (RegionPoints & points : regions) {
+        if (!points.points.empty())
+            kept.push_back(std::move(points));
+    }
+    return kept;
+}
+
+bool write_region_basis(const char * filename, int64_t points,
+    const std::vector<RegionPoints> & regions, const std::vector<Matrix> & bases,
+    const std::vector<Vector> & singular_values, DataType dtype) {
+    if (regions.empty() || regions.size() != bases.size())
+        return false;
+    for (size_t r = 0; r < regions.size(); ++r) {
+        if (bases[r].rows() != int64_t(3 * regions[r].points.size()) || bases[r].cols() == 0 ||
+            regions[r].blend.size() != regions[r].points.size())
+            return false;
+    }
+    FILE * file = fopen(filename, "wb");
+    if (!file)
+        return false;
+
+    RegionHeader header;
+    memset(&header, 0, sizeof(RegionHeader));
+    memcpy(header.magic, REGION_MAGIC, 8);
+    header.version = REGION_VERSION;
+    header.regions = uint32_t(regions.size());
+    header.points  = points;
+    std::vector<RegionEntry> entries(regions.size());
+    memset(entries.data(), 0, entries.size() * sizeof(RegionEntry));
+
+    // Header and table are rewritten once offsets are known.
+    fwrite(&header, sizeof(RegionHeader), 1, file);
+    fwrite(entries.data(), sizeof(RegionEntry), entries.size(), file);
+    for (size_t r = 0; r < regions.size(); ++r) {
+        RegionEntry & entry = entries[r];
+        entry.points         = regions[r].points.size();
+        entry.indices_offset = ftell(file);
+        fwrite(regions[r].points.data(), sizeof(int64_t), entry.points, file);
+        entry.blend_offset   = ftell(file);
+        fwrite(regions[r].blend.data(), sizeof(float), entry.points, file);
+    }
+    bool written = true;
+    for (size_t r = 0; r < regions.size() && written; ++r) {
+        RegionEntry & entry = entries[r];
+        written = pad_to_page(file);
+        entry.matrix_offset = ftell(file);
+        const Vector * singular = r < singular_values.size() ? &singular_values[r] : nullptr;
+        written = written && write_matrix(bases[r], file, singular, dtype);
+        entry.matrix_size = ftell(file) - entry.matrix_offset;
+    }
+    fseek(file, 0, SEEK_SET);
+    fwrite(&header, sizeof(RegionHeader), 1, file);
+    fwrite(entries.data(), sizeof(RegionEntry), entries.size(), file);
+    const bool failed = ferror(file) != 0;
+    return (fclose(file) == 0) && written && !failed;
+}
+
+bool RegionBasis::open(const char * filename, Precision precision, bool verify) {
+    close();
+    m_error.clear();
+    if (!m_file.open(filename, m_error))
+        return fail(m_error);
+    const char * base = m_file.data();
+    const size_t size = m_file.size();
+    RegionHeader header;
+    if (size < sizeof(RegionHeader))
+        return fail("Truncated region file.");
+    memcpy(&header, base, sizeof(RegionHeader));
+    if (memcmp(header.magic, REGION_MAGIC, 8) != 0)
+        return fail("Not a region file.");
+    if (header.version > REGION_VERSION)
+        return fail("Unsupported region file version.");
+    if (header.regions == 0 || !fits(sizeof(RegionHeader), header.regions, sizeof(RegionEntry), size))
+        return fail("Truncated or corrupted region file.");
+    m_points    = header.points;
+    m_precision = precision;
+
+    for (uint32_t r = 0; r < header.regions; ++r) {
+        RegionEntry entry;
+        memcpy(&entry, base + sizeof(RegionHeader) + r * sizeof(RegionEntry), sizeof(RegionEntry));
+        if (entry.points == 0 ||
+            !fits(entry.indices_offset, entry.points, sizeof(int64_t), size) ||
+            !fits(entry.blend_offset, entry.points, sizeof(float), size) ||
+            !fits(entry.matrix_offset, entry.matrix_size, 1, size))
+            return fail("Truncated or corrupted region file.");
+        std::unique_ptr<Region> region(new Region());
+        region->points.resize(entry.points);
+        region->blend.resize(entry.points);
+        memcpy(region->points.data(), base + entry.indices_offset, entry.points * sizeof(int64_t));
+        memcpy(region->blend.data(), base + entry.blend_offset, entry.points * sizeof(float));
+        for (const int64_t point : region->points) {
+            if (point < 0 || point >= m_points)
+                return fail("Region point out of range.");
+        }
+        if (verify) {
+            MappedMatrix check;
+            if (!check.view(base + entry.matrix_offset, entry.matrix_size, true))
+                return fail("Region " + std::to_string(r) + ": " + check.error());
+        }
+        if (!region->basis.view(base + entry.matrix_offset, entry.matrix_size, precision))
+            return fail("Region " + std::to_string(r) + ": " + region->basis.error());
+        if (region->basis.rows() != int64_t(3 * entry.points))
+            return fail("Region matrix doesn't match its points.");
+        m_regions.push_back(std::move(region));
+    }
+    return true;
+}
+
+void RegionBasis::orthonormalize(const RegionBasis & source) {
+    close();
+    m_points    = source.m_points;
+    m_precision = source.m_precision;
+    for (const auto & from : source.m_regions) {
+        std::unique_ptr<Region> region(new Region());
+        region->points = from->points;
+        region->blend  = from->blend;
+        region->basis.orthonormalize(from->basis);
+        m_regions.push_back(std::move(region));
+    }
+}
+
+void RegionBasis::close() {
+    // Region bases may view the mapping, they go first.
+    m_regions.clear();
+    m_file.close();
+    m_points = 0;
+}
+
+int64_t RegionBasis::components() const {
+    int64_t total = 0;
+    for (const auto & region : m_regions)
+        total += region->basis.cols();
+    return total;
+}
+
+size_t RegionBasis::memoryUsage() const {
+    size_t total = 0;
+    for (const auto & region : m_regions) {
+        total += region->basis.memoryUsage()
+            + region->points.size() * (sizeof(int64_t) + sizeof(float));
+    }
+    return total;
+}
+
+bool RegionBasis::prefetch(const std::function<bool(double)> & progress) const {
+    double total = 0, done = 0;
+    for (const auto & region : m_regions)
+        total += double(region->basis.memoryUsage());
+    for (const auto & region : m_regions) {
+        const double size = double(region->basis.memoryUsage());
+        const bool prefetched = region->basis.prefetch([&](double fraction) {
+            return !progress || progress(total > 0 ? (done + fraction * size) / total : 1.0);
+        });
+        if (!prefetched)
+            return false;
+        done += size;
+    }
+    return true;
+}
+
+} // end of subdeform namespace
@@ -0,0 +1,112 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include "basis.hpp"
+#include "matrix_file.hpp"
+
+namespace subdeform {
+
+/// On disk layout of a block-sparse (regional) basis: every region has its
+/// own point list, blend weights and basis over just those points.
+///
+///   [RegionHeader][RegionEntry * regions]
+///   [per region: point indices (int64) and blend weights (float)]
+///   [padding][per region: embedded matrix file (page aligned)]
+///
+/// Embedded matrices are complete matrix files (see matrix_file.hpp), so
+/// they are mapped and read by kernels in place like standalone ones.
+constexpr char     REGION_MAGIC[8]  = {'S','U','B','D','R','G','N','\0'};
+constexpr uint32_t REGION_VERSION   = 1;
+
+struct RegionHeader {
+    char     magic[8];
+    uint32_t version;
+    uint32_t regions;
+    uint64_t points;        // points of the whole mesh
+    uint64_t reserved[13];
+};
+static_assert(sizeof(RegionHeader) == 128, "RegionHeader must stay 128 bytes.");
+
+struct RegionEntry {
+    uint64_t points;         // points in the region (rows / 3 of its matrix)
+    uint64_t indices_offset; // int64 point numbers, ascending
+    uint64_t blend_offset;   // float blend weight per point
+    uint64_t matrix_offset;
+    uint64_t matrix_size;
+    uint64_t reserved[3];
+};
+static_assert(sizeof(RegionEntry) == 64, "RegionEntry must stay 64 bytes.");
+
+/// Points of one region and the weight its reconstruction gets at each of
+/// them. Weights of a point sum to 1 over the regions sharing it (less
+/// for points of no region near one).
+struct RegionPoints {
+    std::vector<int64_t> points;
+    std::vector<float>   blend;
+};
+
+/// True if file starts with REGION_MAGIC.
+bool is_region_basis(const char * filename);
+
+/// Region label of every point from k-means of positions (N x 3), seeded
+/// deterministically by farthest point sampling.
+std::vector<int> cluster_points(const Matrix & positions, int clusters, int iterations=16);
+
+/// Splits points into regions by label (label < 0: no region). With overlap
+/// > 0 a region also takes points closer than 'overlap' to any of its own
+/// ones, blended in with weight falling linearly from 1 at its border to 0
+/// at 'overlap'. Empty regions are dropped.
+std::vector<RegionPoints> build_regions(const Matrix & positions,
+    const std::vector<int> & labels, double overlap);
+
+/// Saves regions and their bases (rows follow regions[r].points) in one file.
+bool write_region_basis(const char * filename, int64_t points,
+    const std::vector<RegionPoints> & regions, const std::vector<Matrix> & bases,
+    const std::vector<Vector> & singular_values, DataType dtype=DataType::Float64);
+
+/// Runtime block-sparse basis: a SubspaceBasis per region over its points
+/// only, so projecting costs sum(N_r * K_r) instead of N * K. Region bases
+/// are views into one mapping of the file.
+class RegionBasis
+{
+public:
+    struct Region {
+        std::vector<int64_t> points;
+        std::vector<float>   blend;
+        SubspaceBasis        basis;
+    };
+
+    bool open(const char * filename, Precision precision, bool verify=false);
+    /// Replaces this basis with thin Q factors of source regions (same
+    /// points and blend weights).
+    void orthonormalize(const RegionBasis & source);
+    void close();
+
+    bool        isOpen()     const { return !m_regions.empty(); }
+    /// Points of the whole mesh.
+    int64_t     points()     const { return m_points; }
+    size_t      size()       const { return m_regions.size(); }
+    const Region & region(size_t index) const { return *m_regions[index]; }
+    /// Sum of region ranks.
+    int64_t     components() const;
+    Precision   precision()  const { return m_precision; }
+    const std::string & error() const { return m_error; }
+    /// Bytes of bases, point lists and blend weights.
+    size_t      memoryUsage() const;
+    /// SubspaceBasis::prefetch() of every region, progress over all of them.
+    bool        prefetch(const std::function<bool(double)> & progress) const;
+
+private:
+    bool fail(const std::string & message) { m_error = message; close(); return false; }
+
+    MappedFile  m_file;
+    std::vector<std::unique_ptr<Region> > m_regions;
+    int64_t     m_points    = 0;
+    Precision   m_precision = Precision::Double;
+    std::string m_error;
+};
+
+} // end of subdeform namespace
@@ -0,0 +1,104 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <GU/GU_Detail.h>
+
+namespace subdeform {
+
+/// Bounded load -> compute pipeline over indexed geometry files.
+///
+/// 'jobs' loader threads decode files into a recycled pool of 2 * jobs
+/// slots (shape + skin GU_Detail), 'jobs' worker threads consume loaded
+/// slots and hand them back. Loaders block when all slots are in flight,
+/// so memory stays bounded however many files there are. Items complete
+/// out of order; callers write results by index to stay deterministic.
+class ShapePipeline
+{
+public:
+    struct Slot {
+        GU_Detail shape;
+        GU_Detail skin;
+    };
+    /// Loads item 'index' into slot, returns false if it should be skipped.
+    using LoadFn    = std::function<bool(int index, Slot & slot)>;
+    /// Consumes item 'index' (loaded tells whether LoadFn succeeded).
+    using ComputeFn = std::function<void(int index, bool loaded, Slot & slot)>;
+
+    explicit ShapePipeline(int jobs) : m_jobs(std::max(1, jobs)) {}
+
+    void run(int count, const LoadFn & load, const ComputeFn & compute) {
+        std::vector<std::unique_ptr<Slot> > slots;
+        std::deque<Slot*> free_slots;
+        for (int i = 0; i < 2*m_jobs; ++i) {
+            slots.emplace_back(new Slot());
+            free_slots.push_back(slots.back().get());
+        }
+        struct Ready { int index; bool loaded; Slot * slot; };
+        std::deque<Ready> ready;
+        std::mutex mutex;
+        std::condition_variable slot_freed, item_ready;
+        std::atomic<int> next_load(0);
+        int consumed = 0;
+
+        auto loader = [&]() {
+            for (int index = next_load++; index < count; index = next_load++) {
+                Slot * slot;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    slot_freed.wait(lock, [&]() { return !free_slots.empty(); });
+                    slot = free_slots.front();
+                    free_slots.pop_front();
+                }
+                const bool loaded = load(index, *slot);
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    ready.push_back(Ready{index, loaded, slot});
+                }
+                item_ready.notify_one();
+            }
+        };
+        auto worker = [&]() {
+            while (true) {
+                Ready item;
+                bool  last;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    item_ready.wait(lock, [&]() { return !ready.empty() || consumed == count; });
+                    if (ready.empty())
+                        return;
+                    item = ready.front();
+                    ready.pop_front();
+                    last = ++consumed == count;
+                }
+                // Wake idle workers so they can exit.
+                if (last)
+                    item_ready.notify_all();
+                compute(item.index, item.loaded, *item.slot);
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    free_slots.push_back(item.slot);
+                }
+                slot_freed.notify_one();
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (int i = 0; i < m_jobs; ++i) {
+            threads.emplace_back(loader);
+            threads.emplace_back(worker);
+        }
+        for (auto & thread : threads)
+            thread.join();
+    }
+
+private:
+    int m_jobs;
+};
+
+} // end of subdeform namespace
@@ -2,194 +2,829 @@
 #include <fstream>
 #include <vector>
 #include <string>
+#include <sstream>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <set>
+#include <stdlib.h>
+#ifndef _WIN32
+#include <limits.h>
+#endif
 #include <GU/GU_Detail.h>
+#include <UT/UT_ParallelUtil.h>
 #include <hboost/program_options.hpp>
 #include "math.hpp"
+#include "matrix_file.hpp"
+#include "psd.hpp"
+#include "basis.hpp"
+#include "region_basis.hpp"
+#include "point_access.hpp"
+#include "weight_stream.hpp"
+#include "profile.hpp"
+#include "shape_pipeline.hpp"
 
 namespace po = hboost::program_options;
 using namespace subdeform;
 
 
-inline void compute_rotation(UT_Vector3 & rest_tanu ) {
+/// Points per block of the PSD kernel, gathered into stack buffers.
+static const int PSD_BLOCK = 256;
 
+/// Gathers rest tangents into normalized SoA frames by point number, once
+/// per rest. Returns false if rest has no tangents.
+bool build_rest_frames(const GU_Detail & rest, TangentFrames & frames)
+{
+    const GA_Attribute * rest_tu = rest.findFloatTuple(GA_ATTRIB_POINT, "tangentu", 3);
+    const GA_Attribute * rest_tv = rest.findFloatTuple(GA_ATTRIB_POINT, "tangentv", 3);
+    if (!rest_tu || !rest_tv)
+        return false;
+
+    frames.resize(rest.getNumPoints());
+    const PointMap points(rest);
+    parallel_point_chunks(rest.getNumPoints(), 
+        [&](const exint, const GA_Index first, const GA_Index last) {
+        float block[3*GA_PAGE_SIZE];
+        for (std::vector<float> * plane : {frames.u, frames.v}) {
+            read_points(plane == frames.u ? rest_tu : rest_tv, points, first, last, block);
+            for (GA_Index index = first; index < last; ++index)
+                for (int axis = 0; axis < 3; ++axis)
+                    plane[axis][index] = block[3*(index - first) + axis];
+        }
+    });
+    frames.normalize();
+    return true;
 }
 
-bool compute_psd(const GU_Detail & rest, const GU_Detail & shape, \
+bool compute_psd(const TangentFrames & rest_frames, const GU_Detail & shape, \
     const GU_Detail & skin, const int shape_index, Matrix & matrix)
 {
-    GA_ROHandleV3 rest_tu_h(rest.findFloatTuple(GA_ATTRIB_POINT, "tangentu", 3));
-    GA_ROHandleV3 rest_tv_h(rest.findFloatTuple(GA_ATTRIB_POINT, "tangentv", 3));
-    GA_ROHandleV3 skin_tu_h(skin.findFloatTuple(GA_ATTRIB_POINT, "tangentu", 3));
-    GA_ROHandleV3 skin_tv_h(skin.findFloatTuple(GA_ATTRIB_POINT, "tangentv", 3));
+    const GA_Attribute * skin_tu = skin.findFloatTuple(GA_ATTRIB_POINT, "tangentu", 3);
+    const GA_Attribute * skin_tv = skin.findFloatTuple(GA_ATTRIB_POINT, "tangentv", 3);
     // This shouldn't happen but anyway...
-    if (rest_tu_h.isInvalid() || rest_tv_h.isInvalid() || 
-        skin_tu_h.isInvalid() || skin_tv_h.isInvalid()) {
+    if (!skin_tu || !skin_tv) {
         return false;
     }
+    // Shape and skin points pair up with rest ones by number.
+    const GA_Index npoints = rest_frames.size();
+    if (shape.getNumPoints() < npoints || skin.getNumPoints() < npoints)
+        return false;
+    const PointMap shape_points(shape);
+    const PointMap skin_points(skin);
 
-    GA_Offset ptoff;
-    UT_Matrix3D m1, m2, m3;
-    GA_FOR_ALL_PTOFF(&rest, ptoff) {
-        const GA_Index   rest_index = rest.pointIndex(ptoff);
-        //const UT_Vector3 rest_pos   = rest.getPos3(ptoff);
-        UT_Vector3 rest_tu          = rest_tu_h.get(ptoff);
-        UT_Vector3 rest_tv          = rest_tv_h.get(ptoff);
-        const GA_Offset  skin_off   = skin.pointOffset(rest_index);
-        const GA_Offset  shape_off  = shape.pointOffset(rest_index);
-
-        if (GAisValid(skin_off) && GAisValid(shape_off)) {
-            const UT_Vector3 skin_pos  = skin.getPos3(skin_off);
-            const UT_Vector3 shape_pos = shape.getPos3(shape_off);
-            UT_Vector3 skin_tu         = skin_tu_h.get(skin_off);
-            UT_Vector3 skin_tv         = skin_tv_h.get(skin_off);
-            UT_Vector3 shape_delta(shape_pos - skin_pos);
-            m3.identity();
-            if (m1.dihedral(skin_tu, rest_tu) && \
-                m2.dihedral(skin_tv, rest_tv)) {
-                m3 = m1 * m2;
+    // Points are independent: gather a block of skin frames and deltas,
+    // rotate it with the SoA kernel and scatter into the column.
+    UTparallelFor(UT_BlockedRange<GA_Index>(0, npoints, PSD_BLOCK),
+        [&](const UT_BlockedRange<GA_Index> & range) {
+        float su[3][PSD_BLOCK], sv[3][PSD_BLOCK], delta[3][PSD_BLOCK];
+        float block[3*PSD_BLOCK];
+        auto to_planes = [&](float (&planes)[3][PSD_BLOCK], const int count) {
+            for (int i = 0; i < count; ++i)
+                for (int axis = 0; axis < 3; ++axis)
+                    planes[axis][i] = block[3*i + axis];
+        };
+        for (GA_Index begin = range.begin(); begin < range.end(); begin += PSD_BLOCK) {
+            const int count = std::min<GA_Index>(PSD_BLOCK, range.end() - begin);
+            read_points(skin_tu, skin_points, begin, begin + count, block);
+            to_planes(su, count);
+            read_points(skin_tv, skin_points, begin, begin + count, block);
+            to_planes(sv, count);
+            read_points(shape.getP(), shape_points, begin, begin + count, block);
+            subtract_points(skin.getP(), skin_points, begin, begin + count, block);
+            to_planes(delta, count);
+            const float * rest_u[3], * rest_v[3];
+            for (int axis = 0; axis < 3; ++axis) {
+                rest_u[axis] = rest_frames.u[axis].data() + begin;
+                rest_v[axis] = rest_frames.v[axis].data() + begin;
+            }
+            const float * skin_u[3] = {su[0], su[1], su[2]};
+            const float * skin_v[3] = {sv[0], sv[1], sv[2]};
+            float * deltas[3]       = {delta[0], delta[1], delta[2]};
+            rotate_to_rest(count, rest_u, rest_v, skin_u, skin_v, deltas);
+            for (int i = 0; i < count; ++i) {
+                matrix(3*(begin+i)+0, shape_index) = delta[0][i];
+                matrix(3*(begin+i)+1, shape_index) = delta[1][i];
+                matrix(3*(begin+i)+2, shape_index) = delta[2][i];
             }
-            shape_delta *= m3;
-            matrix(3*rest_index+0, shape_index) = shape_delta.x();
-            matrix(3*rest_index+1, shape_index) = shape_delta.y();
-            matrix(3*rest_index+2, shape_index) = shape_delta.z();
-        } else {
-            return false;
         }
-    }
+    });
     return true;
 }
 
 bool compute_delta(const GU_Detail & rest, const GU_Detail & shape, \
     const GU_Detail & skin, const int shape_index, Matrix & matrix)
 {
-    GA_Offset ptoff;
-    GA_FOR_ALL_PTOFF(&rest, ptoff) {
-        const GA_Index   rest_index = rest.pointIndex(ptoff);
-        const GA_Offset  skin_off   = skin.pointOffset(rest_index);
-        const GA_Offset  shape_off  = shape.pointOffset(rest_index);
-        //
-        if (GAisValid(skin_off) && GAisValid(shape_off)) {
-            const UT_Vector3 skin_pos   = skin.getPos3(skin_off);
-            const UT_Vector3 shape_pos  = shape.getPos3(shape_off);
-            const UT_Vector3 shape_delta(shape_pos - skin_pos);
-            matrix(3*rest_index+0, shape_index) = shape_delta.x();
-            matrix(3*rest_index+1, shape_index) = shape_delta.y();
-            matrix(3*rest_index+2, shape_index) = shape_delta.z(); 
-        } else {
-            return false;
-        }
-    }
+    // Shape and skin points pair up with rest ones by number.
+    const GA_Index npoints = rest.getNumPoints();
+    if (shape.getNumPoints() < npoints || skin.getNumPoints() < npoints)
+        return false;
+    const PointMap shape_points(shape);
+    const PointMap skin_points(skin);
+    double * column = matrix.col(shape_index).data();
+    parallel_point_chunks(npoints, 
+        [&](const exint, const GA_Index first, const GA_Index last) {
+        read_points(shape.getP(), shape_points, first, last, column + 3*first);
+        subtract_points(skin.getP(), skin_points, first, last, column + 3*first);
+    });
     return true;
 }
 
-bool create_shape_matrix(const std::string & restfile, const StringVec &skinfiles,
-    const StringVec &shapefiles, const bool psd, Matrix &matrix)
+/// Messages of one shape, written at once so that parallel loads don't
+/// interleave their lines.
+struct ShapeLog {
+    std::ostringstream out;
+    std::ostringstream err;
+    ~ShapeLog() {
+        static std::mutex mutex;
+        std::lock_guard<std::mutex> lock(mutex);
+        std::cout << out.str();
+        std::cerr << err.str();
+    }
+};
+
+/// Loads shape (and skin) file. Without skin file only shape is loaded.
+bool load_shape(const GU_Detail & rest, const std::string & shape_file,
+    const std::string * skin_file, GU_Detail & shape_geo, GU_Detail & skin_geo, 
+    ShapeLog & log)
 {
-    GU_Detail rest;
-    if(!rest.load(restfile.c_str()).success()) {
-        std::cerr << "Can't open rest file: " << restfile << '\n';
+    const int npoints = rest.getNumPoints();
+    if(!shape_geo.load(shape_file.c_str()).success()) {
+        log.err << "Can't open shape file, ignoring it: " << shape_file << '\n';
+        return false;
+    } else if (skin_file) {
+        log.out << "Loading shape file: " << shape_file << '\n';
+    }
+
+    if (!skin_file) {
+        if(npoints != shape_geo.getNumPoints()) {
+            log.err << "Point count doesn't match, ignoring this file: " << shape_file << '\n';
+            return false;
+        }
+        return true;
+    }
+
+    auto & skinfile = *skin_file; 
+    if(!skin_geo.load(skinfile.c_str()).success()) {
+        log.err << "Can't open skin file, ignoring it: " << skinfile << '\n';
         return false;
     } else {
-        std::cout << "Loading rest file: " << restfile << '\n';
+         log.out << "Loading skin file: " << skinfile << '\n';
     }
 
-    const int npoints = rest.getNumPoints();
-    matrix.conservativeResize(npoints*3, shapefiles.size());
-    int shapenum = 0;
-    GU_Detail shape_geo;
-    GU_Detail skin_geo;
+    if(npoints != shape_geo.getNumPoints() || npoints != skin_geo.getNumPoints()) {
+        log.err << "Points doesn't match, ignoring these files: " << shape_file << ", " << skinfile << '\n';
+        return false;
+    }
+    return true;
+}
 
-    StringVec::const_iterator it;
-    for (it=shapefiles.begin(); it!= shapefiles.end(); ++it, ++shapenum) {
-        auto & shape_file = *it;
-        if(!shape_geo.load(shape_file.c_str()).success()) {
-            std::cerr << "Can't open shape file, ignoring it: " << shape_file << '\n';
-            continue;
+/// Writes delta of loaded shape into matrix column. Without skin delta is 
+/// taken against rest. PSD needs rest frames (empty if rest has no tangents).
+/// Returns false (column left as it was) if the delta can't be computed.
+bool shape_delta(const GU_Detail & rest, const TangentFrames & frames,
+    const GU_Detail & shape_geo, const GU_Detail * skin_geo, const bool psd,
+    const int column, Matrix & matrix, ShapeLog & log)
+{
+    if (!skin_geo)
+        return compute_delta(rest, shape_geo, rest, column, matrix);
+
+    // Tangents are on place
+    if (!frames.empty()                                         && 
+        skin_geo->findFloatTuple(GA_ATTRIB_POINT, "tangentu", 3) && 
+        skin_geo->findFloatTuple(GA_ATTRIB_POINT, "tangentv", 3) && psd) {
+
+        if(compute_psd(frames, shape_geo, *skin_geo, column, matrix)) {
+           log.out << "Computed pose space deformation #: " << column + 1 << '\n'; 
         } else {
-            std::cout << "Loading shape file: " << shape_file << '\n';
+            log.err << "Can't compute pose space deformation #: " << column + 1 << '\n';
+            return false;
         }
-        auto & skinfile = skinfiles.at(shapenum); 
-        if(!skin_geo.load(skinfile.c_str()).success()) {
-            std::cerr << "Can't open skin file, ignoring it: " << skinfile << '\n';
-            continue;
+    // Proceed in case of lack of tangents: TODO: make them by yourself
+    } else {
+        if(compute_delta(rest, shape_geo, *skin_geo, column, matrix)) {
+        log.err << "No tangents found, proceeding without them... " << '\n';
+           log.out << "Computed delta #: " << column + 1 << '\n'; 
         } else {
-             std::cout << "Loading skin file: " << skinfile << '\n';
+            log.err << "Can't compute delta #: " << column + 1 << '\n';
+            return false;
         }
+    }
+    return true;
+}
 
-        if(npoints != shape_geo.getNumPoints() || npoints != skin_geo.getNumPoints()) {
-            std::cerr << "Points doesn't match, ignoring these files: " << shape_file << ", " << skinfile << '\n';
+/// Drops columns of shapes which weren't filled in, keeping order of the rest.
+void compact_columns(Matrix & matrix, const std::vector<char> & filled)
+{
+    int shapenum = 0;
+    for (size_t index = 0; index < filled.size(); ++index) {
+        if (!filled[index])
             continue;
-        }
-
-        // Tangents are on place
-        if (rest.findFloatTuple(GA_ATTRIB_POINT, "tangentu", 3)     && 
-            rest.findFloatTuple(GA_ATTRIB_POINT, "tangentv", 3)     && 
-            skin_geo.findFloatTuple(GA_ATTRIB_POINT, "tangentu", 3) && 
-            skin_geo.findFloatTuple(GA_ATTRIB_POINT, "tangentv", 3) && psd) {
+        if (shapenum != (int)index)
+            matrix.col(shapenum) = matrix.col(index);
+        shapenum++;
+    }
+    matrix.conservativeResize(matrix.rows(), shapenum);
+}
 
-            if(compute_psd(rest, shape_geo, skin_geo, shapenum, matrix)) {
-               std::cout << "Computed pose space deformation #: " << shapenum + 1 << '\n'; 
-            } else {
-                std::cerr << "Can't compute pose space deformation for: " << shape_file << '\n';
-            }
-        // Proceed in case of lack of tangents: TODO: make them by yourself
+bool create_shape_matrix(const std::string & restfile, const StringVec &skinfiles,
+    const StringVec &shapefiles, const bool psd, const int jobs, Matrix &matrix,
+    Profile * profile=nullptr)
+{
+    GU_Detail rest;
+    {
+        ScopedStage stage(profile, Stage::Load);
+        if(!rest.load(restfile.c_str()).success()) {
+            std::cerr << "Can't open rest file: " << restfile << '\n';
+            return false;
         } else {
-            if(compute_delta(rest, shape_geo, skin_geo, shapenum, matrix)) {
-            std::cerr << "No tangents found, proceeding without them... " << '\n';
-               std::cout << "Computed delta #: " << shapenum + 1 << '\n'; 
-            } else {
-                std::cerr << "Can't compute delta for: " << shape_file << '\n';
-            }
+            std::cout << "Loading rest file: " << restfile << '\n';
         }
+    }
 
+    const int npoints = rest.getNumPoints();
+    matrix.conservativeResize(npoints*3, shapefiles.size());
+    std::vector<char> filled(shapefiles.size(), 0);
+    TangentFrames frames;
+    if (psd)
+        build_rest_frames(rest, frames);
 
-    }
+    // Loads and deltas overlap, pipeline's wall time is split between them.
+    FusedStages stages(profile, Stage::Load, Stage::Delta);
+    // Column of a shape is its index, whichever thread gets it first.
+    ShapePipeline(jobs).run(shapefiles.size(), 
+        [&](int index, ShapePipeline::Slot & slot) {
+            ShapeLog log;
+            const auto start = stages.now();
+            const bool loaded = load_shape(rest, shapefiles[index], &skinfiles.at(index), 
+                slot.shape, slot.skin, log);
+            stages.add(stages.now() - start, ProfileClock::duration(0));
+            return loaded;
+        },
+        [&](int index, bool loaded, ShapePipeline::Slot & slot) {
+            ShapeLog log;
+            const auto start = stages.now();
+            filled[index] = loaded && shape_delta(rest, frames, slot.shape, &slot.skin, psd, index, matrix, log);
+            stages.add(ProfileClock::duration(0), stages.now() - start);
+        });
 
+    // Skipped files leave no empty columns behind, order of the rest is kept.
+    compact_columns(matrix, filled);
     return true;
 }
 
 
 bool create_shape_matrix(const std::string &restfile, 
-    const StringVec &shapefiles, Matrix &matrix)
+    const StringVec &shapefiles, const int jobs, Matrix &matrix, Profile * profile=nullptr)
 {
     GU_Detail rest;
-    if(!rest.load(restfile.c_str()).success()) {
-        std::cerr << "Can't open rest file " << restfile << '\n';
-        return false;
+    {
+        ScopedStage stage(profile, Stage::Load);
+        if(!rest.load(restfile.c_str()).success()) {
+            std::cerr << "Can't open rest file " << restfile << '\n';
+            return false;
+        }
     }
 
     const int npoints = rest.getNumPoints();
     matrix.conservativeResize(npoints*3, shapefiles.size());
-    GA_Offset ptoff;
-    int shapenum = 0;
-    GU_Detail shape;
-    for (auto file: shapefiles) {
-        if(!shape.load(file.c_str()).success()) {
-            std::cerr << "Can't open shape file, ignoring it: " << file << '\n';
-            continue;
+    std::vector<char> filled(shapefiles.size(), 0);
+
+    FusedStages stages(profile, Stage::Load, Stage::Delta);
+    ShapePipeline(jobs).run(shapefiles.size(), 
+        [&](int index, ShapePipeline::Slot & slot) {
+            ShapeLog log;
+            const auto start = stages.now();
+            const bool loaded = load_shape(rest, shapefiles[index], nullptr, slot.shape, slot.skin, log);
+            stages.add(stages.now() - start, ProfileClock::duration(0));
+            return loaded;
+        },
+        [&](int index, bool loaded, ShapePipeline::Slot & slot) {
+            ShapeLog log;
+            const auto start = stages.now();
+            filled[index] = loaded && shape_delta(rest, TangentFrames(), slot.shape, nullptr, false, index, matrix, log);
+            stages.add(ProfileClock::duration(0), stages.now() - start);
+        });
+
+    // Skipped files leave no empty columns behind, order of the rest is kept.
+    compact_columns(matrix, filled);
+    return true;
+}
+
+/// Streams shapes through IncrementalPCA 'chunk' columns at a time, so the
+/// full 3N x shapes matrix never exists in memory.
+bool stream_shape_pca(const std::string & restfile, const StringVec &skinfiles,
+    const StringVec &shapefiles, const bool psd, const int chunk, IncrementalPCA & pca,
+    Profile * profile=nullptr)
+{
+    GU_Detail rest;
+    {
+        ScopedStage stage(profile, Stage::Load);
+        if(!rest.load(restfile.c_str()).success()) {
+            std::cerr << "Can't open rest file: " << restfile << '\n';
+            return false;
         }
-        if(npoints != shape.getNumPoints()) {
-            std::cerr << "Point count doesn't match, ignoring this file: " << file << '\n';
+    }
+
+    const int npoints = rest.getNumPoints();
+    if (pca.rows() && pca.rows() != npoints*3) {
+        std::cerr << "Rest points count differs from appended basis." << '\n';
+        return false;
+    }
+    Matrix block(npoints*3, chunk);
+    if (profile)
+        profile->alloc_bytes += block.size() * sizeof(double);
+    TangentFrames frames;
+    if (psd)
+        build_rest_frames(rest, frames);
+    GU_Detail shape_geo;
+    GU_Detail skin_geo;
+    int filled = 0;
+    for (size_t shapenum = 0; shapenum < shapefiles.size(); ++shapenum) {
+        const std::string * skinfile = skinfiles.size() ? &skinfiles.at(shapenum) : nullptr;
+        ShapeLog log;
+        bool loaded;
+        {
+            ScopedStage stage(profile, Stage::Load);
+            loaded = load_shape(rest, shapefiles[shapenum], skinfile, shape_geo, skin_geo, log);
+        }
+        if (!loaded)
             continue;
+        {
+            ScopedStage stage(profile, Stage::Delta);
+            if (!shape_delta(rest, frames, shape_geo, skinfile ? &skin_geo : nullptr, psd, filled, block, log))
+                continue;
         }
-        GA_FOR_ALL_PTOFF(&rest, ptoff) {
-            const GA_Index   rest_index = rest.pointIndex(ptoff);
-            const UT_Vector3 rest_pos   = rest.getPos3(ptoff);
-            const GA_Offset  shape_off  = shape.pointOffset(rest_index);
-            const UT_Vector3 shape_pos  = shape.getPos3(shape_off);
-            const UT_Vector3 shape_delta(shape_pos - rest_pos);
-            matrix(3*rest_index+0, shapenum) = shape_delta.x();
-            matrix(3*rest_index+1, shapenum) = shape_delta.y();
-            matrix(3*rest_index+2, shapenum) = shape_delta.z(); 
+        if (++filled == chunk) {
+            ScopedStage stage(profile, Stage::PCA);
+            pca.update(block);
+            std::cout << "Updated PCA with " << pca.samples() << " shapes." << '\n';
+            filled = 0;
         }
-        shapenum++;
     }
+    ScopedStage stage(profile, Stage::PCA);
+    pca.update(block.leftCols(filled));
+    return pca.samples() > 0;
+}
+
+/// Reports the error a lossy dtype (half, int16, int8) introduced into
+/// matrix written to filename: relative Frobenius and max abs error, and the
+/// worst column's relative error (what reconstructing that shape/component
+/// loses).
+void report_storage_error(const Matrix & matrix, const std::string & filename)
+{
+    MappedMatrix stored;
+    if (!stored.open(filename.c_str())) {
+        std::cerr << "Can't read matrix " << filename << ": " << stored.error() << '\n';
+        return;
+    }
+    Matrix restored;
+    stored.copyTo(restored);
+    const Matrix error = restored - matrix;
+    double worst = 0;
+    for (int64_t c = 0; c < matrix.cols(); ++c) {
+        const double norm = matrix.col(c).norm();
+        if (norm > 0)
+            worst = std::max(worst, error.col(c).norm() / norm);
+    }
+    std::cout << "Storage error (relative): " << error.norm() / matrix.norm() << '\n';
+    std::cout << "Storage error (max abs) : " << error.cwiseAbs().maxCoeff() << '\n';
+    std::cout << "Worst column error (relative): " << worst << '\n';
+}
 
+/// Writes the basis of an IncrementalPCA (orthonormalized with norm) along
+/// with energy and samples it has seen, so shapes can be appended to it later.
+bool write_incremental_pca(const IncrementalPCA & pca, const bool norm, const DataType dtype,
+    const std::string & matrix_file, Profile & profile)
+{
+    Matrix pca_matrix;
+    Vector singular_values;
+    {
+        ScopedStage stage(&profile, Stage::PCA);
+        pca.finalize(pca_matrix, singular_values);
+        if (norm)
+            orthogonalize_matrix(pca_matrix, 0);
+    }
+    std::cout << "Components: " << pca_matrix.cols() << '\n';
+    {
+        ScopedStage stage(&profile, Stage::Write);
+        if(!write_matrix(pca_matrix, matrix_file.c_str(), &singular_values, dtype,
+            pca.energy(), pca.samples())) {
+            std::cerr << "Can't write matrix to file: " << matrix_file << '\n';
+            return false;
+        }
+    }
+    if (dtype != DataType::Float64)
+        report_storage_error(pca_matrix, matrix_file);
+    profile.points      = pca_matrix.rows() / 3;
+    profile.components  = pca_matrix.cols();
+    profile.alloc_bytes += pca_matrix.size() * sizeof(double);
+    return true;
+}
+
+/// Rest positions (N x 3, by point number) and, with 'attrib', every
+/// point's region label read from that integer point attribute.
+bool load_region_labels(const std::string & restfile, const std::string & attrib,
+    Matrix & positions, std::vector<int> & labels)
+{
+    GU_Detail rest;
+    if (!rest.load(restfile.c_str()).success()) {
+        std::cerr << "Can't open rest file: " << restfile << '\n';
+        return false;
+    }
+    GA_ROHandleI label_h;
+    if (!attrib.empty()) {
+        label_h = GA_ROHandleI(rest.findIntTuple(GA_ATTRIB_POINT, attrib.c_str(), 1));
+        if (label_h.isInvalid()) {
+            std::cerr << "No integer point attribute " << attrib << " on rest." << '\n';
+            return false;
+        }
+    }
+    const GA_Index npoints = rest.getNumPoints();
+    const PointMap points(rest);
+    std::vector<double> xyz(3*npoints);
+    read_points(rest.getP(), points, 0, npoints, xyz.data());
+    positions = Eigen::Map<const Eigen::Matrix<double, Eigen::Dynamic, 3, Eigen::RowMajor> >(
+        xyz.data(), npoints, 3);
+    labels.assign(npoints, 0);
+    if (label_h.isValid()) {
+        for (GA_Index index = 0; index < npoints; ++index)
+            labels[index] = label_h.get(points.offset(index));
+    }
     return true;
 }
 
+/// PCA of every region's rows of the shape matrix. Regions no shape moves
+/// are dropped (their points get no displacement from them either way).
+void compute_region_pca(const Matrix & shapes, std::vector<RegionPoints> & regions,
+    const double variance, const bool orthonormalize, const std::string & solver_str,
+    std::vector<Matrix> & bases, std::vector<Vector> & singular_values)
+{
+    const double total = shapes.squaredNorm();
+    std::vector<RegionPoints> kept;
+    for (RegionPoints & region : regions) {
+        const int64_t count = region.points.size();
+        Matrix rows(3*count, shapes.cols());
+        for (int64_t i = 0; i < count; ++i)
+            rows.middleRows(3*i, 3) = shapes.middleRows(3*region.points[i], 3);
+        if (rows.squaredNorm() <= 1e-12 * total)
+            continue;
+        PCASolver solver = PCASolver::Jacobi;
+        if (solver_str == "gram" || (solver_str == "auto" && 8 * rows.cols() <= rows.rows()))
+            solver = PCASolver::Gram;
+        else if (solver_str == "randomized")
+            solver = PCASolver::Randomized;
+        Matrix pca_matrix;
+        Vector singular;
+        computePCA(rows, pca_matrix, variance, false, orthonormalize, &singular, solver);
+        std::cout << "Region " << kept.size() << ": " << count << " points, " 
+                  << pca_matrix.cols() << " components" << '\n';
+        bases.push_back(std::move(pca_matrix));
+        singular_values.push_back(std::move(singular));
+        kept.push_back(std::move(region));
+    }
+    regions.swap(kept);
+}
+
+/// Writes profile as one line of JSON to 'target' ("-" for stdout).
+bool write_profile(const Profile & profile, const std::string & target)
+{
+    if (target == "-") {
+        std::cout << profile.json() << '\n';
+        return true;
+    }
+    std::ofstream file(target);
+    if (!(file << profile.json() << '\n')) {
+        std::cerr << "Can't write profile to: " << target << '\n';
+        return false;
+    }
+    return true;
+}
+
+/// Runs fn(index) for every index in [0, count) on up to 'jobs' threads.
+void parallel_for(const int count, const int jobs, const std::function<void(int)> & fn)
+{
+    std::atomic<int> next(0);
+    auto worker = [&]() {
+        for (int index = next++; index < count; index = next++)
+            fn(index);
+    };
+    std::vector<std::thread> threads;
+    for (int i = 1; i < std::min(jobs, count); ++i)
+        threads.emplace_back(worker);
+    worker();
+    for (auto & thread : threads)
+        thread.join();
+}
+
+/// Settings of the project subcommand.
+struct ProjectOptions {
+    StringVec   frames;
+    std::string outdir;
+    std::string weightsfile;
+    float       scale = 1.f;
+    double      start = 1.0;  // frame number of the first frame
+    bool        ortho = false;
+    int         block = 64;
+    int         jobs  = 1;
+};
+
+/// Corrected frame's file: frame's file name in the output directory.
+std::string frame_output(const ProjectOptions & options, const std::string & frame_file)
+{
+    return options.outdir + '/' + frame_file.substr(frame_file.find_last_of("/\\") + 1);
+}
+
+/// Absolute path (directory symlinks resolved) of a file which may not
+/// exist yet, empty if its directory doesn't.
+std::string canonical_path(const std::string & filename)
+{
+    const size_t slash = filename.find_last_of("/\\");
+    const std::string dir = slash == std::string::npos ? "." : filename.substr(0, slash + 1);
+#ifdef _WIN32
+    char resolved[_MAX_PATH];
+    if (!_fullpath(resolved, dir.c_str(), _MAX_PATH))
+        return std::string();
+#else
+    char resolved[PATH_MAX];
+    if (!realpath(dir.c_str(), resolved))
+        return std::string();
+#endif
+    std::string path(resolved);
+    if (path.empty() || (path.back() != '/' && path.back() != '\\'))
+        path += '/';
+    return path + filename.substr(slash + 1);
+}
+
+/// Frames [first, first + count) of a sequence: their geometry and deltas
+/// (P - rest) as columns of a 3N x block matrix.
+template<typename T>
+struct FrameBlock {
+    std::vector<std::unique_ptr<GU_Detail> > geo;
+    std::vector<char> loaded;
+    Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> delta;
+    int first = 0;
+    int count = 0;
+};
+
+/// Loads frames of a block in parallel and gathers their deltas. Rest is
+/// taken from 'rest' if given, from frame's rest attribute otherwise.
+/// Frames which can't be used keep a zero delta and loaded = 0.
+template<typename T>
+void load_frame_block(const ProjectOptions & options, const std::vector<UT_Vector3> * rest,
+    const GA_Size npoints, FrameBlock<T> & block)
+{
+    parallel_for(block.count, options.jobs, [&](int i) {
+        const std::string & frame_file = options.frames[block.first + i];
+        GU_Detail & geo = *block.geo[i];
+        auto delta = block.delta.col(i);
+        ShapeLog log;
+        delta.setZero();
+        block.loaded[i] = 0;
+        if (!geo.load(frame_file.c_str()).success()) {
+            log.err << "Can't open frame file, ignoring it: " << frame_file << '\n';
+            return;
+        }
+        if (geo.getNumPoints() != npoints) {
+            log.err << "Point count doesn't match, ignoring this file: " << frame_file << '\n';
+            return;
+        }
+        const GA_Attribute * rest_attrib = geo.findFloatTuple(GA_ATTRIB_POINT, "rest", 3);
+        if (!rest && !rest_attrib) {
+            log.err << "No rest attribute (nor --rest file), ignoring this file: " << frame_file << '\n';
+            return;
+        }
+        // Frames load in parallel already, each one is read serially.
+        const PointMap points(geo);
+        if (rest) {
+            read_points(geo.getP(), points, 0, npoints, delta.data());
+            for (GA_Index index = 0; index < npoints; ++index)
+                for (int axis = 0; axis < 3; ++axis)
+                    delta(3*index + axis) -= (*rest)[index](axis);
+        } else {
+            read_point_deltas(geo.getP(), rest_attrib, points, 0, npoints, delta.data());
+        }
+        block.loaded[i] = 1;
+    });
+}
+
+/// Projects a frame sequence onto basis block by block: weights of a whole
+/// block come from one GEMM (U^T * deltas), corrected frames from another
+/// (P += scale * U * weights). The next block loads while the current one
+/// is projected and written, so at most two blocks of frames are in memory.
+/// With normal, weights are least squares ones (see NormalSolver).
+template<typename T>
+bool project_frames(const ProjectOptions & options, const SubspaceBasis & basis,
+    const std::vector<UT_Vector3> * rest, const NormalSolver * normal)
+{
+    using Block = Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>;
+    const int     nframes = options.frames.size();
+    const int     size    = std::min(options.block, nframes);
+    const GA_Size npoints = basis.rows() / 3;
+
+    FrameBlock<T> blocks[2];
+    for (FrameBlock<T> & block : blocks) {
+        for (int i = 0; i < size; ++i)
+            block.geo.emplace_back(new GU_Detail());
+        block.loaded.resize(size);
+        block.delta.resize(basis.rows(), size);
+    }
+    Block  weights(basis.cols(), size);
+    Block  displacement;
+    WeightStreamWriter stream;
+    if (!options.outdir.empty())
+        displacement.resize(basis.rows(), size);
+    if (!options.weightsfile.empty() && !stream.open(options.weightsfile.c_str(), 
+        basis.cols(), basis.rows(), options.ortho ? WEIGHTS_ORTHONORMAL : 0)) {
+        std::cerr << "Can't write weights to file: " << options.weightsfile << '\n';
+        return false;
+    }
+
+    auto load = [&](FrameBlock<T> & block, const int first) {
+        block.first = first;
+        block.count = std::min(size, nframes - first);
+        load_frame_block(options, rest, npoints, block);
+    };
+    load(blocks[0], 0);
+    int projected = 0;
+    for (int first = 0, current = 0; first < nframes; first += size, current ^= 1) {
+        FrameBlock<T> & block = blocks[current];
+        std::thread loader;
+        if (first + size < nframes)
+            loader = std::thread(load, std::ref(blocks[current ^ 1]), first + size);
+
+        basis.projectBlock(block.delta.data(), block.count, weights.data());
+        if (normal)
+            normal->solveBlock(weights.data(), block.count);
+        for (int i = 0; i < block.count; ++i) {
+            if (block.loaded[i] && stream.isOpen())
+                stream.write(options.start + block.first + i, weights.col(i).data());
+            projected += block.loaded[i];
+        }
+
+        if (displacement.size()) {
+            basis.reconstructBlock(weights.data(), block.count, displacement.data());
+            parallel_for(block.count, options.jobs, [&](int i) {
+                if (!block.loaded[i])
+                    return;
+                GU_Detail & geo = *block.geo[i];
+                add_points(geo.getP(), PointMap(geo), 0, npoints, displacement.col(i).data(),
+                    options.scale);
+                const std::string output = frame_output(options, options.frames[block.first + i]);
+                ShapeLog log;
+                if (!geo.save(output.c_str(), nullptr).success())
+                    log.err << "Can't write frame file: " << output << '\n';
+                else
+                    log.out << "Written frame: " << output << '\n';
+            });
+        }
+        if (loader.joinable())
+            loader.join();
+    }
+
+    std::cout << "Projected " << projected << " of " << nframes << " frames." << '\n';
+    if (stream.isOpen() && !stream.close()) {
+        std::cerr << "Can't write weights to file: " << options.weightsfile << '\n';
+        return false;
+    }
+    return projected > 0;
+}
+
+/// subdeform project: batch projection of animated sequences onto a basis,
+/// the command line counterpart of SOP_Subdeform.
+int project_main(int argc, char *argv[])
+{
+    try
+    {
+        po::options_description options("subdeform project options");
+        options.add_options()
+            ("basis,b",    po::value<std::string>()->required(),             "Subspace basis file (*.matrix)")
+            ("frames,f",   po::value<StringVec>()->multitoken()->required(), "Input frame files  (*.bgeo)")
+            ("rest,r",     po::value<std::string>(),                          \
+                "Rest file (.bgeo); if omitted frames' rest attribute is used")
+            ("output,o",   po::value<std::string>(),                          "Directory of corrected frames")
+            ("weights,w",  po::value<std::string>(),                          "Weight stream file (*.wstream)")
+            ("start-frame", po::value<double>()->default_value(1.0),         "Frame number of the first frame (in weight stream)")
+            ("mode,m",     po::value<std::string>()->default_value("ortho"),  \
+                "Deform mode: ortho (P -= s*Q*Q^T*(P-rest)), pca (P += s*U*U^T*(P-rest)) or "
+                "lsq (P += s*U*w, w least squares fit of P-rest, for raw shape bases)")
+            ("regularization", po::value<double>()->default_value(0.0),    \
+                "Tikhonov regularization of lsq mode, relative to mean squared column norm")
+            ("strength,s", po::value<float>()->default_value(1.f),           "Strength (s)")
+            ("precision",  po::value<std::string>()->default_value("single"), "Compute precision (double, single)")
+            ("block",      po::value<int>()->default_value(64),               "Frames projected per matrix product")
+            ("jobs,j",     po::value<int>()->default_value(0),                "Loader/writer threads (0: number of cores)")
+            ("help,h",                                                        "Prints this screen.");
+
+        po::variables_map result;
+        po::store(po::parse_command_line(argc, argv, options), result);
+
+        if (result.count("help") || argc == 1) {
+            std::cout << options << '\n';
+            return 0;
+        }
+
+        po::notify(result);
+
+        ProjectOptions project;
+        project.frames = result["frames"].as<StringVec>();
+        project.block  = std::max(1, result["block"].as<int>());
+        project.jobs   = result["jobs"].as<int>();
+        if (project.jobs <= 0)
+            project.jobs = std::max(1u, std::thread::hardware_concurrency());
+        if (result.count("output"))
+            project.outdir = result["output"].as<std::string>();
+        if (result.count("weights"))
+            project.weightsfile = result["weights"].as<std::string>();
+        if (project.outdir.empty() && project.weightsfile.empty()) {
+            std::cerr << "Nothing to write, use --output and/or --weights." << '\n';
+            return 1;
+        }
+        // Frames are written under their own names, an output directory
+        // holding inputs would silently overwrite them.
+        if (!project.outdir.empty()) {
+            std::set<std::string> inputs;
+            for (const std::string & frame : project.frames)
+                inputs.insert(canonical_path(frame));
+            for (const std::string & frame : project.frames) {
+                const std::string output = canonical_path(frame_output(project, frame));
+                if (!output.empty() && inputs.count(output)) {
+                    std::cerr << "Output would overwrite input frame: " << frame << '\n';
+                    return 1;
+                }
+            }
+        }
+
+        const std::string & mode = result["mode"].as<std::string>();
+        const float strength = result["strength"].as<float>();
+        if (mode != "ortho" && mode != "pca" && mode != "lsq") {
+            std::cerr << "Unknown deform mode: " << mode << '\n';
+            return 1;
+        }
+        project.scale = mode == "ortho" ? -strength : strength;
+        project.ortho = mode == "ortho";
+        project.start = result["start-frame"].as<double>();
+
+        const std::string & precision_str = result["precision"].as<std::string>();
+        if (precision_str != "double" && precision_str != "single") {
+            std::cerr << "Unknown precision: " << precision_str << '\n';
+            return 1;
+        }
+        const Precision precision = precision_str == "double" ? Precision::Double : Precision::Single;
+
+        const std::string & basisfile = result["basis"].as<std::string>();
+        SubspaceBasis basis;
+        if (!basis.open(basisfile.c_str(), precision)) {
+            std::cerr << "Can't open basis file: " << basisfile << " (" << basis.error() << ")" << '\n';
+            return 1;
+        }
+        // Same spaces as SOP_Subdeform's deform modes.
+        if (mode == "ortho")
+            basis.orthonormalize();
+        NormalSolver normal;
+        if (mode == "lsq") {
+            Matrix gram;
+            basis.gram(gram);
+            normal.factor(gram, result["regularization"].as<double>());
+        }
+        std::cout << "Using basis: " << basisfile << ", points: " << basis.rows() / 3 
+                  << ", components: " << basis.cols() << '\n';
+
+        std::vector<UT_Vector3> rest;
+        if (result.count("rest")) {
+            const std::string & restfile = result["rest"].as<std::string>();
+            GU_Detail rest_geo;
+            if (!rest_geo.load(restfile.c_str()).success()) {
+                std::cerr << "Can't open rest file: " << restfile << '\n';
+                return 1;
+            }
+            if (rest_geo.getNumPoints() != basis.rows() / 3) {
+                std::cerr << "Rest points count differs from basis." << '\n';
+                return 1;
+            }
+            rest.resize(rest_geo.getNumPoints());
+            read_points(rest_geo.getP(), PointMap(rest_geo), 0, rest_geo.getNumPoints(),
+                rest[0].data());
+        }
+
+        const std::vector<UT_Vector3> * rest_ptr = rest.empty() ? nullptr : &rest;
+        const NormalSolver * normal_ptr = normal.isValid() ? &normal : nullptr;
+        const bool ok = precision == Precision::Double 
+            ? project_frames<double>(project, basis, rest_ptr, normal_ptr)
+            : project_frames<float>(project, basis, rest_ptr, normal_ptr);
+        return ok ? 0 : 1;
+    } catch (const std::exception &ex) {
+        std::cerr << ex.what() << '\n';
+        return 1;
+    }
+}
+
 int main(int argc, char *argv[])
 {
+    if (argc > 1 && std::string(argv[1]) == "project")
+        return project_main(argc - 1, argv + 1);
+
     try 
     {
         po::options_description options("subdeform options");
@@ -200,8 +835,30 @@ int main(int argc, char *argv[])
             ("output,o", po::value<std::string>()->required(),             "Output file       (*.matrix)")
             ("var,v",    po::value<double>(),                              "PCA Variance (if omitted, PCA won't be performed)")
             ("norm,n",   po::bool_switch()->default_value(false),             "Orthonormalize PCA")
+            ("dtype,t",  po::value<std::string>()->default_value("double"), "Output storage type (double, float, half, int16, int8)")
+            ("solver",   po::value<std::string>()->default_value("jacobi"), \
+                "PCA solver (jacobi, gram, randomized, auto); auto picks gram for shapes << points")
+            ("check-pca", po::bool_switch()->default_value(false),          \
+                "Compare PCA solver against exact (jacobi) one and report its error")
+            ("stream",   po::bool_switch()->default_value(false),          \
+                "Incremental PCA over chunks of shapes, never holding all of them (requires --var)")
+            ("chunk",    po::value<int>()->default_value(32),              "Shapes per chunk in --stream mode")
+            ("max-rank", po::value<int>()->default_value(0),               "Upper bound of components kept in --stream and PCA --append modes")
+            ("jobs,j",   po::value<int>()->default_value(0),               "Loader/worker threads (0: number of cores)")
             ("psd,p",    po::bool_switch()->default_value(false),           \
                 "Compute pose space deformation (requires tangents vectors)")
+            ("regions",  po::value<std::string>(),                         \
+                "Integer point attribute on rest splitting the mesh into regions with a PCA basis each (requires --var)")
+            ("clusters", po::value<int>(),                                 \
+                "Split the mesh into this many regions by k-means of rest positions instead (requires --var)")
+            ("overlap",  po::value<double>()->default_value(0.0),          \
+                "Distance regions extend into their neighbours, blending linearly across it")
+            ("append",   po::value<std::string>(),                         \
+                "Existing basis (*.matrix) to add the shapes to: PCA bases are updated incrementally (requires --var), raw ones get shapes appended")
+            ("append-raw", po::bool_switch()->default_value(false),        \
+                "Confirms an --append file without singular values holds raw shapes (needed with --var)")
+            ("profile",  po::value<std::string>()->implicit_value("-"),    \
+                "Write timings of load, delta, PCA and write stages as JSON to a file (stdout without one)")
             ("help,h",                                                     "Prints this screen.");
 
         po::variables_map result;        
@@ -209,6 +866,7 @@ int main(int argc, char *argv[])
 
         if (result.count("help") || argc == 1) {
             std::cout << options << '\n';
+            std::cout << "Batch projection of animations: subdeform project --help" << '\n';
             return 0;
         }
 
@@ -239,55 +897,307 @@ int main(int argc, char *argv[])
         std::cout << "Using " << shapefiles.size() <<  " shapes: " \
             << shapefiles[0] << "...\n";
 
+        DataType dtype = DataType::Float64;
+        const std::string & dtype_str = result["dtype"].as<std::string>();
+        if (dtype_str == "float") {
+            dtype = DataType::Float32;
+        } else if (dtype_str == "half") {
+            dtype = DataType::Float16;
+        } else if (dtype_str == "int16") {
+            dtype = DataType::Int16;
+        } else if (dtype_str == "int8") {
+            dtype = DataType::Int8;
+        } else if (dtype_str != "double") {
+            std::cerr << "Unknown storage type: " << dtype_str << '\n';
+            return 1;
+        }
+
         /// Create matrix from skin and deforemed sequence
         const bool psd = result["psd"].as<bool>();
+
+        // Stage timings are always collected (a few clock reads per shape).
+        const ProfileClock::time_point run_start = ProfileClock::now();
+        const std::string profile_file = result.count("profile") ? result["profile"].as<std::string>() : "";
+        Profile profile;
+        profile.path = "shapes";
+
+        const bool regional = result.count("regions") || result.count("clusters");
+        if (regional && (!result.count("var") || result["stream"].as<bool>())) {
+            std::cerr << "--regions/--clusters require --var and don't stream." << '\n';
+            return 1;
+        }
+
+        /// Existing basis the shapes are added to. PCA bases (with singular
+        /// values) seed an IncrementalPCA, so only new shapes are loaded and
+        /// the SVD is a rank-k update instead of a full one.
+        Matrix  appended;
+        Vector  appended_singular;
+        double  appended_energy  = 0;
+        int64_t appended_samples = 0;
+        if (result.count("append")) {
+            const std::string & append_file = result["append"].as<std::string>();
+            if (regional || is_region_basis(append_file.c_str())) {
+                std::cerr << "--append doesn't support region bases." << '\n';
+                return 1;
+            }
+            ScopedStage stage(&profile, Stage::Load);
+            // Copied and unmapped right away, so output may replace the file.
+            MappedMatrix existing;
+            if (!existing.open(append_file.c_str(), true)) {
+                std::cerr << "Can't read matrix " << append_file << ": " << existing.error() << '\n';
+                return 1;
+            }
+            existing.copyTo(appended);
+            appended_singular = existing.singularValues();
+            appended_energy   = existing.energy();
+            appended_samples  = existing.samples() ? existing.samples() : existing.cols();
+            if (appended_singular.size() && !result.count("var")) {
+                std::cerr << "--append to a PCA basis requires --var." << '\n';
+                return 1;
+            }
+            // PCA bases of older versions (and legacy files) have no singular
+            // values either, re-running PCA over their columns and raw shapes
+            // would silently give a wrong basis.
+            if (!appended_singular.size() && result.count("var") && !result["append-raw"].as<bool>()) {
+                std::cerr << append_file << " has no singular values, it may be a PCA basis of an older "
+                    << "version. Pass --append-raw if it holds raw shapes." << '\n';
+                return 1;
+            }
+            // Lossy storage left columns only nearly orthonormal.
+            if (appended_singular.size() && existing.dtype() != DataType::Float64)
+                orthogonalize_matrix(appended, 0);
+            std::cout << "Appending to " << appended.cols() << " columns of " << append_file
+                << (appended_singular.size() ? " (PCA basis)" : "") << '\n';
+        }
+
+        if (result["stream"].as<bool>()) {
+            if (!result.count("var")) {
+                std::cerr << "--stream requires --var." << '\n';
+                return 1;
+            }
+            const int chunk = std::max(1, result["chunk"].as<int>());
+            IncrementalPCA pca(result["var"].as<double>(), result["max-rank"].as<int>());
+            if (appended_singular.size())
+                pca.seed(appended, appended_singular, appended_samples, appended_energy);
+            else if (appended.size())
+                pca.update(appended);
+            profile.threads = 1;
+            profile.path    = appended.size() ? "append stream pca" : "stream pca";
+            if (!stream_shape_pca(restfile, skinfiles, shapefiles, psd, chunk, pca, &profile)) {
+                std::cerr << "Can't compute streamed PCA." << '\n';
+                return 1;
+            }
+            if (!write_incremental_pca(pca, result["norm"].as<bool>(), dtype, matrix_file, profile))
+                return 1;
+            profile.wall        = seconds_since(run_start);
+            if (!profile_file.empty() && !write_profile(profile, profile_file))
+                return 1;
+            return 0;
+        }
+
+        int jobs = result["jobs"].as<int>();
+        if (jobs <= 0)
+            jobs = std::max(1u, std::thread::hardware_concurrency());
+        profile.threads = jobs;
         Matrix shapes_matrix;
         if (skinfiles.size() != 0) {
-            if (!create_shape_matrix(restfile, skinfiles, shapefiles, psd,  shapes_matrix)) {
+            if (!create_shape_matrix(restfile, skinfiles, shapefiles, psd, jobs, shapes_matrix, &profile)) {
                 std::cerr << "Can't create shape matrix." << '\n';
                 return 1;  
             }
         } else {
-            if (!create_shape_matrix(restfile, shapefiles, shapes_matrix)) {
+            if (!create_shape_matrix(restfile, shapefiles, jobs, shapes_matrix, &profile)) {
                 std::cerr << "Can't create shape matrix." << '\n';
                 return 1;   
             }
         }
+        if (appended.size() && appended.rows() != shapes_matrix.rows()) {
+            std::cerr << "Rest points count differs from appended basis." << '\n';
+            return 1;
+        }
+        if (appended_singular.size()) {
+            IncrementalPCA pca(result["var"].as<double>(), result["max-rank"].as<int>());
+            profile.path = "append pca";
+            {
+                ScopedStage stage(&profile, Stage::PCA);
+                pca.seed(appended, appended_singular, appended_samples, appended_energy);
+                pca.update(shapes_matrix);
+            }
+            if (!write_incremental_pca(pca, result["norm"].as<bool>(), dtype, matrix_file, profile))
+                return 1;
+            std::cout << "Shapes: " << pca.samples() << '\n';
+            profile.alloc_bytes += (appended.size() + shapes_matrix.size()) * sizeof(double);
+            profile.wall         = seconds_since(run_start);
+            if (!profile_file.empty() && !write_profile(profile, profile_file))
+                return 1;
+            return 0;
+        }
+        // Raw matrices just grow by the new shapes.
+        if (appended.size()) {
+            Matrix joined(shapes_matrix.rows(), appended.cols() + shapes_matrix.cols());
+            joined << appended, shapes_matrix;
+            shapes_matrix.swap(joined);
+            appended.resize(0, 0);
+        }
+        /// Block-sparse basis: a PCA per region, all in one file.
+        if (regional) {
+            Matrix positions;
+            std::vector<int> labels;
+            const std::string attrib = result.count("regions") ? result["regions"].as<std::string>() : "";
+            {
+                ScopedStage stage(&profile, Stage::Load);
+                if (!load_region_labels(restfile, attrib, positions, labels))
+                    return 1;
+            }
+            if (positions.rows() * 3 != shapes_matrix.rows()) {
+                std::cerr << "Rest points count differs from shapes." << '\n';
+                return 1;
+            }
+            const std::string & solver_str = result["solver"].as<std::string>();
+            if (solver_str != "auto" && solver_str != "jacobi" && solver_str != "gram" 
+                && solver_str != "randomized") {
+                std::cerr << "Unknown PCA solver: " << solver_str << '\n';
+                return 1;
+            }
+            std::vector<RegionPoints> regions;
+            std::vector<Matrix> bases;
+            std::vector<Vector> singular_values;
+            profile.path = "region pca";
+            {
+                ScopedStage stage(&profile, Stage::PCA);
+                if (result.count("clusters"))
+                    labels = cluster_points(positions, std::max(1, result["clusters"].as<int>()));
+                regions = build_regions(positions, labels, result["overlap"].as<double>());
+                compute_region_pca(shapes_matrix, regions, result["var"].as<double>(), 
+                    result["norm"].as<bool>(), solver_str, bases, singular_values);
+            }
+            if (regions.empty()) {
+                std::cerr << "No region is deformed by the shapes." << '\n';
+                return 1;
+            }
+            {
+                ScopedStage stage(&profile, Stage::Write);
+                if (!write_region_basis(matrix_file.c_str(), positions.rows(), regions, 
+                    bases, singular_values, dtype)) {
+                    std::cerr << "Can't write matrix to file: " << matrix_file << '\n';
+                    return 1;
+                }
+            }
+            RegionBasis check;
+            if (!check.open(matrix_file.c_str(), Precision::Double, true)) {
+                std::cerr << "Can't read matrix " << matrix_file << ": " << check.error() << '\n';
+                return 1;
+            }
+            // Projection cost relative to one basis of all components over all points.
+            int64_t entries = 0;
+            for (size_t r = 0; r < check.size(); ++r)
+                entries += check.region(r).basis.rows() * check.region(r).basis.cols();
+            std::cout << "Matrix seems to be fine... " << '\n';
+            std::cout << "Regions: " << check.size() << '\n';
+            std::cout << "Points: " << check.points() << '\n';
+            std::cout << "Shapes: " << check.components() << '\n';
+            std::cout << "Basis entries: " << entries << " (dense: " 
+                      << 3 * check.points() * check.components() << ")" << '\n';
+            profile.points       = check.points();
+            profile.components   = check.components();
+            profile.alloc_bytes += shapes_matrix.size() * sizeof(double);
+            profile.wall         = seconds_since(run_start);
+            if (!profile_file.empty() && !write_profile(profile, profile_file))
+                return 1;
+            return 0;
+        }
+
         /// Save
         if (result.count("var")) {
             Matrix pca_matrix;
+            Vector singular_values;
             const double variance       = result["var"].as<double>();
             const bool   orthonormalize = result["norm"].as<bool>(); 
-            std::cout << "Computing PCA... " << std::flush; 
-            if(!computePCA(shapes_matrix, pca_matrix, variance, orthonormalize)) {
-                std::cerr << "Can't compute PCA matrix." << '\n';
+            const std::string & solver_str = result["solver"].as<std::string>();
+            PCASolver solver = PCASolver::Jacobi;
+            if (solver_str == "gram" || (solver_str == "auto" && 
+                8 * shapes_matrix.cols() <= shapes_matrix.rows())) {
+                solver = PCASolver::Gram;
+            } else if (solver_str == "randomized") {
+                solver = PCASolver::Randomized;
+            } else if (solver_str != "jacobi" && solver_str != "auto") {
+                std::cerr << "Unknown PCA solver: " << solver_str << '\n';
                 return 1;
-            } else {
-                std::cout << "done"  << '\n';
             }
+            const double energy = shapes_matrix.squaredNorm();
+            Matrix exact_input;
+            if (result["check-pca"].as<bool>())
+                exact_input = shapes_matrix;
 
-            if(!write_matrix(pca_matrix, matrix_file.c_str())) {
-                std::cerr << "Can't write matrix to file: " << matrix_file << '\n';
-                return 1;
+            std::cout << "Computing PCA... " << std::flush; 
+            profile.path = "pca";
+            {
+                ScopedStage stage(&profile, Stage::PCA);
+                if(!computePCA(shapes_matrix, pca_matrix, variance, false, 
+                    orthonormalize, &singular_values, solver)) {
+                    std::cerr << "Can't compute PCA matrix." << '\n';
+                    return 1;
+                } else {
+                    std::cout << "done"  << '\n';
+                }
+            }
+
+            if (exact_input.size()) {
+                Matrix exact_matrix;
+                Vector exact_singular;
+                std::cout << "Computing exact PCA for comparison... " << std::flush; 
+                computePCA(exact_input, exact_matrix, variance, false, false, 
+                    &exact_singular, PCASolver::Jacobi);
+                double singular_error, subspace_error;
+                comparePCA(exact_matrix, exact_singular, pca_matrix, singular_values,
+                    singular_error, subspace_error);
+                std::cout << "done" << '\n';
+                std::cout << "Rank (exact/solver): " << exact_matrix.cols() << "/" << pca_matrix.cols() << '\n';
+                std::cout << "Max singular value error: " << singular_error << '\n';
+                std::cout << "Subspace error (RMS): " << subspace_error << '\n';
             }
 
+            {
+                ScopedStage stage(&profile, Stage::Write);
+                if(!write_matrix(pca_matrix, matrix_file.c_str(), &singular_values, dtype,
+                    energy, shapes_matrix.cols())) {
+                    std::cerr << "Can't write matrix to file: " << matrix_file << '\n';
+                    return 1;
+                }
+            }
+            if (dtype != DataType::Float64)
+                report_storage_error(pca_matrix, matrix_file);
+            profile.components   = pca_matrix.cols();
+            profile.alloc_bytes += pca_matrix.size() * sizeof(double);
+
         } else {
-            if(!write_matrix(shapes_matrix, matrix_file.c_str())) {
-                std::cerr << "Can't write matrix to file: " << matrix_file << '\n';
-                return 1;
+            {
+                ScopedStage stage(&profile, Stage::Write);
+                if(!write_matrix(shapes_matrix, matrix_file.c_str(), nullptr, dtype)) {
+                    std::cerr << "Can't write matrix to file: " << matrix_file << '\n';
+                    return 1;
+                }
             }
+            if (dtype != DataType::Float64)
+                report_storage_error(shapes_matrix, matrix_file);
+            profile.components = shapes_matrix.cols();
         }
+        profile.points       = shapes_matrix.rows() / 3;
+        profile.alloc_bytes += shapes_matrix.size() * sizeof(double);
         // check;
-        Matrix second_matrix;
-        if(!read_matrix(matrix_file.c_str(), second_matrix)) {
-            std::cerr << "Can't read matrix" << matrix_file << '\n';
+        MappedMatrix second_matrix;
+        if(!second_matrix.open(matrix_file.c_str(), true)) {
+            std::cerr << "Can't read matrix " << matrix_file << ": " << second_matrix.error() << '\n';
             return 1;
         } else {
             std::cout << "Matrix seems to be fine... " << '\n';
             std::cout << "Points: " << second_matrix.rows() / 3 << '\n';
             std::cout << "Shapes: " << second_matrix.cols() << '\n';
-            std::cout << "Size  : " << second_matrix.rows() * second_matrix.cols() * sizeof(double) / 1024 << "KB\n";  
+            std::cout << "Size  : " << second_matrix.rows() * second_matrix.cols() * dtype_size(second_matrix.dtype()) / 1024 << "KB\n";  
         }
+        profile.wall = seconds_since(run_start);
+        if (!profile_file.empty() && !write_profile(profile, profile_file))
+            return 1;
 
     } catch (const std::exception &ex) {
         std::cerr << ex.what() << '\n';
@@ -0,0 +1,128 @@
+// Checks of the Houdini independent basis code (subdeform_math), run by
+// ctest. Each check prints one line and the exit code is the number of
+// failed ones.
+#include <cstdio>
+#include <string>
+#include "math.hpp"
+#include "matrix_file.hpp"
+#include "basis.hpp"
+#include "basis_cache.hpp"
+
+using namespace subdeform;
+
+namespace {
+
+int failures = 0;
+
+void check(bool passed, const std::string & name) {
+    printf("%s: %s\n", passed ? "ok" : "FAILED", name.c_str());
+    failures += !passed;
+}
+
+const char * dtype_name(DataType dtype) {
+    switch (dtype) {
+        case DataType::Float64: return "double";
+        case DataType::Float32: return "float";
+        case DataType::Float16: return "half";
+        case DataType::Int16:   return "int16";
+        case DataType::Int8:    return "int8";
+    }
+    return "";
+}
+
+/// toMatrix() of a column prefix view (and of rows gathered from it) has
+/// to be the leading columns of the full basis, for every storage.
+void test_truncated_views(const std::string & filename) {
+    // More rows than a scale block, so quantized columns have several scales.
+    const int64_t rows = 3 * 1500;
+    const int64_t cols = 12;
+    const int64_t rank = 5;
+    const Matrix source = Matrix::Random(rows, cols);
+    const Vector singular = Vector::LinSpaced(cols, double(cols), 1.0);
+    for (const DataType dtype : {DataType::Float64, DataType::Float32, DataType::Float16,
+        DataType::Int16, DataType::Int8}) {
+        if (!write_matrix(source, filename.c_str(), &singular, dtype)) {
+            check(false, std::string("write ") + dtype_name(dtype));
+            continue;
+        }
+        for (const Precision precision : {Precision::Double, Precision::Single}) {
+            const std::string name = std::string(dtype_name(dtype))
+                + (precision == Precision::Double ? " as double" : " as single");
+            SubspaceBasis full;
+            if (!full.open(filename.c_str(), precision)) {
+                check(false, "open " + name);
+                continue;
+            }
+            Matrix expected;
+            full.toMatrix(expected);
+
+            SubspaceBasis view;
+            view.viewColumns(full, rank);
+            Matrix truncated;
+            view.toMatrix(truncated);
+            check(truncated.rows() == rows && truncated.cols() == rank
+                && truncated == expected.leftCols(rank), "toMatrix of column prefix, " + name);
+            check(view.singularValues() == singular.head(rank), "singular values of prefix, " + name);
+
+            const std::vector<int64_t> points = {0, 7, 1023, 1024, 1499};
+            SubspaceBasis gathered;
+            gathered.gatherRows(view, points);
+            Matrix rows_matrix;
+            gathered.toMatrix(rows_matrix);
+            // Gathering dequantizes in the basis precision, toMatrix() in double.
+            const double tolerance = precision == Precision::Double ? 0 : 1e-6;
+            bool same = rows_matrix.rows() == 3 * int64_t(points.size()) && rows_matrix.cols() == rank;
+            for (size_t i = 0; same && i < points.size(); ++i) {
+                const Matrix difference = rows_matrix.middleRows(3*i, 3) - expected.block(3*points[i], 0, 3, rank);
+                same = difference.cwiseAbs().maxCoeff() <= tolerance;
+            }
+            check(same, "toMatrix of rows gathered from prefix, " + name);
+        }
+    }
+    remove(filename.c_str());
+}
+
+/// Derived products count against the cache budget: building one evicts
+/// unreferenced entries once the total exceeds it.
+void test_cache_budget(const std::string & filename) {
+    const std::string unused = filename + ".unused";
+    const std::string used   = filename + ".used";
+    const Matrix source = Matrix::Random(3 * 1000, 8);
+    if (!write_matrix(source, unused.c_str()) || !write_matrix(source, used.c_str())) {
+        check(false, "write cache matrices");
+        return;
+    }
+    BasisCache & cache = BasisCache::instance();
+    cache.purge();
+    std::string error;
+    const size_t bytes = source.size() * sizeof(double);
+    // Room for both bases, not for a thin Q on top.
+    cache.setBudget(2 * bytes + bytes / 2);
+    cache.acquire(unused.c_str(), Precision::Double, error);
+    const BasisHandle shared = cache.acquire(used.c_str(), Precision::Double, error);
+    check(shared && cache.usage() == 2 * bytes, "cache keeps unreferenced entry within budget");
+    if (shared) {
+        shared->ortho();
+        check(cache.usage() == 2 * bytes, "thin Q evicts unreferenced entry");
+        Matrix q;
+        shared->ortho().toMatrix(q);
+        check((q.transpose() * q - Matrix::Identity(8, 8)).norm() < 1e-10
+            && (q * (q.transpose() * source) - source).norm() < 1e-10 * source.norm(),
+            "thin Q is orthonormal and spans the basis");
+        shared->gram();
+        check(cache.usage() == 2 * bytes + 8 * 8 * sizeof(double), "Gram matrix is accounted");
+    }
+    cache.purge();
+    remove(unused.c_str());
+    remove(used.c_str());
+}
+
+} // end of anonymous namespace
+
+int main(int argc, char *argv[])
+{
+    const std::string filename = argc > 1 ? argv[1] : "subdeform_test.matrix";
+    test_truncated_views(filename);
+    test_cache_budget(filename);
+    return failures;
+}
@@ -0,0 +1,194 @@
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include "weight_stream.hpp"
+
+namespace subdeform {
+
+namespace {
+bool seek64(FILE * file, uint64_t offset) {
+#ifdef _WIN32
+    return _fseeki64(file, offset, SEEK_SET) == 0;
+#else
+    return fseeko(file, offset, SEEK_SET) == 0;
+#endif
+}
+
+/// Converts between T and the stream's record dtype.
+template<typename From, typename To>
+void convert(const void * from, void * to, int64_t count) {
+    using FromMap = Eigen::Map<const Eigen::Matrix<From, Eigen::Dynamic, 1> >;
+    using ToMap   = Eigen::Map<Eigen::Matrix<To, Eigen::Dynamic, 1> >;
+    ToMap(static_cast<To*>(to), count) =
+        FromMap(static_cast<const From*>(from), count).template cast<To>();
+}
+
+template<typename T>
+void to_record(const T * weights, DataType dtype, int64_t count, void * record) {
+    switch (dtype) {
+        case DataType::Float64: convert<T, double>(weights, record, count); break;
+        case DataType::Float32: convert<T, float>(weights, record, count); break;
+        case DataType::Float16: convert<T, Eigen::half>(weights, record, count); break;
+        // Writer rejects quantized dtypes.
+        case DataType::Int16:
+        case DataType::Int8:    assert(false && "quantized weight stream"); break;
+    }
+}
+
+template<typename T>
+void from_record(const void * record, DataType dtype, int64_t count, T * weights) {
+    switch (dtype) {
+        case DataType::Float64: convert<double, T>(record, weights, count); break;
+        case DataType::Float32: convert<float, T>(record, weights, count); break;
+        case DataType::Float16: convert<Eigen::half, T>(record, weights, count); break;
+        // Reader rejects quantized dtypes.
+        case DataType::Int16:
+        case DataType::Int8:    assert(false && "quantized weight stream"); break;
+    }
+}
+} // end of anonymous namespace
+
+bool WeightStreamWriter::open(const char * filename, int64_t components,
+    int64_t basis_rows, uint32_t flags, DataType dtype) {
+    close();
+    m_error.clear();
+    m_index.clear();
+    if (components <= 0)
+        return fail("No components to write.");
+    if (is_quantized(dtype))
+        return fail("Weight streams hold floating point weights only.");
+    m_file = fopen(filename, "wb");
+    if (!m_file)
+        return fail("Can't open file.");
+    memset(&m_header, 0, sizeof(WeightStreamHeader));
+    memcpy(m_header.magic, WEIGHT_STREAM_MAGIC, 8);
+    m_header.version    = WEIGHT_STREAM_VERSION;
+    m_header.dtype      = static_cast<uint32_t>(dtype);
+    m_header.flags      = flags;
+    m_header.components = components;
+    m_header.basis_rows = basis_rows;
+    m_record.resize(components * dtype_size(dtype));
+    // Rewritten with index offset on close.
+    fwrite(&m_header, sizeof(WeightStreamHeader), 1, m_file);
+    return ferror(m_file) == 0 || fail("Can't write file.");
+}
+
+bool WeightStreamWriter::write(double frame, const double * weights) {
+    if (!m_file)
+        return false;
+    to_record(weights, static_cast<DataType>(m_header.dtype), m_header.components, m_record.data());
+    return append(frame, m_record.data());
+}
+
+bool WeightStreamWriter::write(double frame, const float * weights) {
+    if (!m_file)
+        return false;
+    to_record(weights, static_cast<DataType>(m_header.dtype), m_header.components, m_record.data());
+    return append(frame, m_record.data());
+}
+
+bool WeightStreamWriter::append(double frame, const void * record) {
+    m_index.push_back(WeightStreamEntry{frame, m_index.size()});
+    fwrite(record, 1, m_record.size(), m_file);
+    return ferror(m_file) == 0 || fail("Can't write file.");
+}
+
+bool WeightStreamWriter::close() {
+    if (!m_file)
+        return m_error.empty();
+    // Stable: a frame written twice resolves to its first record.
+    std::stable_sort(m_index.begin(), m_index.end(),
+        [](const WeightStreamEntry & a, const WeightStreamEntry & b) { return a.frame < b.frame; });
+    m_header.frames       = m_index.size();
+    m_header.index_offset = sizeof(WeightStreamHeader) + m_index.size() * m_record.size();
+    m_header.checksum     = checksum64(m_index.data(), m_index.size() * sizeof(WeightStreamEntry));
+    fwrite(m_index.data(), sizeof(WeightStreamEntry), m_index.size(), m_file);
+    seek64(m_file, 0);
+    fwrite(&m_header, sizeof(WeightStreamHeader), 1, m_file);
+    const bool failed = ferror(m_file) != 0;
+    fclose(m_file);
+    m_file = nullptr;
+    m_index.clear();
+    if (failed)
+        m_error = "Can't write file.";
+    return !failed && m_error.empty();
+}
+
+bool WeightStreamWriter::fail(const std::string & message) {
+    m_error = message;
+    return false;
+}
+
+bool WeightStream::open(const char * filename) {
+    close();
+    m_error.clear();
+    m_file = fopen(filename, "rb");
+    if (!m_file)
+        return fail("Can't open file.");
+    if (fread(&m_header, sizeof(WeightStreamHeader), 1, m_file) != 1 ||
+        memcmp(m_header.magic, WEIGHT_STREAM_MAGIC, 8) != 0)
+        return fail("Not a weight stream.");
+    if (m_header.version > WEIGHT_STREAM_VERSION)
+        return fail("Unsupported weight stream version.");
+    if (m_header.dtype > static_cast<uint32_t>(DataType::Float16))
+        return fail("Unsupported weight stream data type.");
+    if (m_header.index_offset == 0)
+        return fail("Unfinished weight stream (no index).");
+    m_record.resize(m_header.components * dtype_size(dtype()));
+    if (m_header.index_offset != sizeof(WeightStreamHeader) + m_header.frames * m_record.size())
+        return fail("Corrupted weight stream.");
+    m_index.resize(m_header.frames);
+    if (!seek64(m_file, m_header.index_offset) ||
+        fread(m_index.data(), sizeof(WeightStreamEntry), m_index.size(), m_file) != m_index.size())
+        return fail("Truncated weight stream.");
+    if (checksum64(m_index.data(), m_index.size() * sizeof(WeightStreamEntry)) != m_header.checksum)
+        return fail("Weight stream checksum mismatch.");
+    for (const WeightStreamEntry & entry : m_index) {
+        if (entry.record >= m_header.frames)
+            return fail("Corrupted weight stream.");
+    }
+    return true;
+}
+
+void WeightStream::close() {
+    if (m_file)
+        fclose(m_file);
+    m_file = nullptr;
+    m_index.clear();
+    m_header = WeightStreamHeader();
+}
+
+int64_t WeightStream::find(double frame) const {
+    if (m_index.empty())
+        return -1;
+    const auto it = std::lower_bound(m_index.begin(), m_index.end(), frame,
+        [](const WeightStreamEntry & entry, double value) { return entry.frame < value; });
+    if (it == m_index.end())
+        return m_index.size() - 1;
+    if (it != m_index.begin() && frame - (it - 1)->frame <= it->frame - frame)
+        return it - m_index.begin() - 1;
+    return it - m_index.begin();
+}
+
+bool WeightStream::readRecord(int64_t i) {
+    if (!m_file || i < 0 || i >= frames())
+        return false;
+    const uint64_t offset = sizeof(WeightStreamHeader) + m_index[i].record * m_record.size();
+    return seek64(m_file, offset) && fread(m_record.data(), 1, m_record.size(), m_file) == m_record.size();
+}
+
+bool WeightStream::read(int64_t i, double * weights) {
+    if (!readRecord(i))
+        return false;
+    from_record(m_record.data(), dtype(), components(), weights);
+    return true;
+}
+
+bool WeightStream::read(int64_t i, float * weights) {
+    if (!readRecord(i))
+        return false;
+    from_record(m_record.data(), dtype(), components(), weights);
+    return true;
+}
+
+} // end of subdeform namespace
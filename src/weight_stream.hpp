@@ -0,0 +1,117 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "matrix_file.hpp"
+
+namespace subdeform {
+
+/// On disk layout of a weight stream (version 1), K subspace coefficients
+/// per frame instead of 3N positions:
+///
+///   [WeightStreamHeader][record 0: K * dtype][record 1]...[index]
+///
+/// Records are appended as frames get projected, the index (frame number,
+/// record) sorted by frame is written on close, so any frame is one seek
+/// away. A stream without index (writer didn't finish) is rejected.
+constexpr char     WEIGHT_STREAM_MAGIC[8] = {'S','U','B','D','W','G','T','\0'};
+constexpr uint32_t WEIGHT_STREAM_VERSION  = 1;
+
+enum WeightStreamFlags : uint32_t {
+    /// Weights are coefficients of the basis' thin Q (ortho deform mode),
+    /// not of the basis itself.
+    WEIGHTS_ORTHONORMAL = 1 << 0,
+};
+
+struct WeightStreamHeader {
+    char     magic[8];
+    uint32_t version;
+    uint32_t dtype;
+    uint32_t flags;
+    uint32_t reserved;
+    uint64_t components;
+    uint64_t basis_rows;    // rows (3N) of the basis weights belong to
+    uint64_t frames;        // records (and index entries)
+    uint64_t index_offset;  // 0 until the writer closes the stream
+    uint64_t checksum;      // checksum64 of the index
+};
+static_assert(sizeof(WeightStreamHeader) == 64, "WeightStreamHeader must stay 64 bytes.");
+
+struct WeightStreamEntry {
+    double   frame;
+    uint64_t record;
+};
+
+/// Appends per frame weights to a stream file.
+class WeightStreamWriter
+{
+public:
+    WeightStreamWriter() = default;
+    ~WeightStreamWriter() { close(); }
+    WeightStreamWriter(const WeightStreamWriter &) = delete;
+    WeightStreamWriter & operator=(const WeightStreamWriter &) = delete;
+
+    bool open(const char * filename, int64_t components, int64_t basis_rows,
+        uint32_t flags=0, DataType dtype=DataType::Float32);
+    /// Appends weights (components values) of a frame.
+    bool write(double frame, const double * weights);
+    bool write(double frame, const float * weights);
+    /// Writes the index and final header. Returns false if any write failed.
+    bool close();
+
+    bool isOpen() const { return m_file != nullptr; }
+    const std::string & error() const { return m_error; }
+
+private:
+    bool fail(const std::string & message);
+    bool append(double frame, const void * record);
+
+    FILE *             m_file = nullptr;
+    WeightStreamHeader m_header = WeightStreamHeader();
+    std::vector<WeightStreamEntry> m_index;
+    std::vector<char>  m_record;
+    std::string        m_error;
+};
+
+/// Random access reader of a weight stream. Only the header and index are
+/// kept in memory, a frame's weights are read on demand. Not thread safe.
+class WeightStream
+{
+public:
+    WeightStream() = default;
+    ~WeightStream() { close(); }
+    WeightStream(const WeightStream &) = delete;
+    WeightStream & operator=(const WeightStream &) = delete;
+
+    bool open(const char * filename);
+    void close();
+
+    bool      isOpen()     const { return m_file != nullptr; }
+    int64_t   components() const { return m_header.components; }
+    int64_t   basisRows()  const { return m_header.basis_rows; }
+    int64_t   frames()     const { return m_index.size(); }
+    uint32_t  flags()      const { return m_header.flags; }
+    DataType  dtype()      const { return static_cast<DataType>(m_header.dtype); }
+    /// Frame number of i-th entry (entries are sorted by frame).
+    double    frame(int64_t i) const { return m_index[i].frame; }
+    const std::string & error() const { return m_error; }
+
+    /// Entry of the frame nearest to 'frame' (-1 if stream is empty).
+    int64_t   find(double frame) const;
+    /// Reads weights of i-th entry, converted to double/float.
+    bool      read(int64_t i, double * weights);
+    bool      read(int64_t i, float * weights);
+
+private:
+    bool fail(const std::string & message) { m_error = message; close(); return false; }
+    bool readRecord(int64_t i);
+
+    FILE *             m_file = nullptr;
+    WeightStreamHeader m_header = WeightStreamHeader();
+    std::vector<WeightStreamEntry> m_index;
+    std::vector<char>  m_record;
+    std::string        m_error;
+};
+
+} // end of subdeform namespace